@@ -29,12 +29,11 @@
 #include <ctype.h>
 #include <time.h>
 #include <errno.h>
-#include <signal.h>
 #include "tcp.h"
 
 
 #define SERVER_PORT 80
-#define TIME_OUT 5
+#define TIME_OUT 5000000  /* usec we wait for the server at a time */
 #define DATE_TIME_FORMAT "%a, %d %b %Y %H:%M:%S GMT"
 #define PROTOCOL "HTTP/1.0"
 #define VERSION "Tiny httpc/1.0 ({lmbronwa,mvermaat}@cs.vu.nl)"
@@ -45,9 +44,12 @@
 #define FILENAME_LENGTH 255
 #define HEADER_LINE_LENGTH 200      /* used for some small temporary buffers */
 #define CLOSE_READ_BUFFER_SIZE 1024
+#define COOKIE_FILE ".httpc_cookie"  /* Fast Open cookie of the last server */
 
 
 int do_request(char *ip, char *filename);
+void load_cookie(char *ip);
+void save_cookie(char *ip);
 int handle_response(char *ip, char *filename);
 int get_response_header(char *buffer, int max_length);
 int parse_url(char *url, char *ip, int ip_length, char *filename,
@@ -60,14 +62,6 @@ int parse_header(char *buffer, int buffer_size, char *header, int header_length,
 int read_separator(char *buffer, int buffer_size);
 
 
-static int alarm_went_off = 0;
-
-
-static void alarm_handler(int sig) {
-    alarm_went_off = 1;
-}
-
-
 /*
   Returns: 0 on success, otherwise failure
 */
@@ -79,6 +73,7 @@ int main(int argc, char** argv) {
     char ip[IP_LENGTH];
     char filename[FILENAME_LENGTH];
     char buffer[CLOSE_READ_BUFFER_SIZE];
+    tcp_u32t deadline;
  
     if (argc < 2) {
         printf("No url found\nUsage: %s url\n", argv[0]);
@@ -109,13 +104,7 @@ int main(int argc, char** argv) {
         return 1;
     }
 
-    /* connect to http server */
-    if (tcp_connect(inet_aton(ip), SERVER_PORT)) {
-        printf("Request failed: could not connect to server\n");
-        return 0;
-    }
-
-    /* do request */
+    /* connect to http server and do request */
     if (!do_request(ip, filename)) {
         tcp_close();
         return 1;
@@ -133,10 +122,8 @@ int main(int argc, char** argv) {
         return 1;
     }
 
-    signal(SIGALRM, alarm_handler);
-    alarm(TIME_OUT);
-    while (tcp_read(buffer, RESPONSE_BUFFER_SIZE) > 0) {}
-    alarm(0);
+    deadline = tcp_now() + TIME_OUT;
+    while (tcp_read_deadline(0, buffer, CLOSE_READ_BUFFER_SIZE, deadline) > 0) {}
 
     return 0;
 
@@ -144,7 +131,9 @@ int main(int argc, char** argv) {
 
 
 /*
-  Send HTTP GET request to server
+  Connect to server and send HTTP GET request; the request goes
+  with the last ack of the handshake, or with the SYN if the server
+  gave us a Fast Open cookie before
   Returns: 1 on success, 0 on failure
 */
 
@@ -167,8 +156,12 @@ int do_request(char *ip, char *filename) {
         return 0;
     }
 
-    /* send request */
-    sent = tcp_write(request_buffer, request_length);
+    /* connect and send request */
+    tcp_fastopen(1);
+    load_cookie(ip);
+    sent = tcp_connect_write(inet_aton(ip), SERVER_PORT,
+                             request_buffer, request_length);
+    save_cookie(ip);
 
     /* sending data failed */
     if (sent != request_length) {
@@ -181,6 +174,65 @@ int do_request(char *ip, char *filename) {
 }
 
 
+/*
+  Give the Fast Open cookie in COOKIE_FILE to tcp, if it is for ip
+*/
+
+void load_cookie(char *ip) {
+
+    FILE *file;
+    char cookie_ip[IP_LENGTH];
+    char cookie[TFO_COOKIE_MAX];
+    unsigned int byte;
+    int length = 0;
+
+    file = fopen(COOKIE_FILE, "r");
+    if (!file) {
+        return;
+    }
+
+    if (fscanf(file, "%17s", cookie_ip) == 1 && !strcmp(cookie_ip, ip)) {
+        while (length < TFO_COOKIE_MAX && fscanf(file, "%2x", &byte) == 1) {
+            cookie[length++] = byte;
+        }
+        tcp_set_fastopen_cookie(inet_aton(ip), cookie, length);
+    }
+
+    fclose(file);
+
+}
+
+
+/*
+  Keep the Fast Open cookie tcp has for ip in COOKIE_FILE
+*/
+
+void save_cookie(char *ip) {
+
+    FILE *file;
+    char cookie[TFO_COOKIE_MAX];
+    int i, length;
+
+    length = tcp_fastopen_cookie(inet_aton(ip), cookie);
+    if (length == 0) {
+        return;
+    }
+
+    file = fopen(COOKIE_FILE, "w");
+    if (!file) {
+        return;
+    }
+
+    fprintf(file, "%s ", ip);
+    for (i = 0; i < length; i++) {
+        fprintf(file, "%02x", (unsigned char) cookie[i]);
+    }
+    fprintf(file, "\n");
+    fclose(file);
+
+}
+
+
 /*
   Receive response from server and process it
   Returns: 1 on success, 0 on failure
@@ -290,14 +342,11 @@ int handle_response(char *ip, char *filename) {
             pointer++;
         }
 
-        signal(SIGALRM, alarm_handler);
-        alarm(TIME_OUT);
-        buffer_size = tcp_read(buffer, RESPONSE_BUFFER_SIZE);
-        alarm(0);
+        buffer_size = tcp_read_deadline(0, buffer, RESPONSE_BUFFER_SIZE,
+                                        tcp_now() + TIME_OUT);
 
         /* failed reading */
-        if (buffer_size < 0
-            || alarm_went_off) {
+        if (buffer_size < 0) {
             /*
               Actually, we should write to a temp file
               and delete it here. Only if all data is
@@ -341,15 +390,12 @@ int get_response_header(char *buffer, int max_length) {
 
     do {
 
-        signal(SIGALRM, alarm_handler);
-        alarm(TIME_OUT);
-        length = tcp_read(buffer + total_length,
-                          max_length - total_length);
-        alarm(0);
+        length = tcp_read_deadline(0, buffer + total_length,
+                                   max_length - total_length,
+                                   tcp_now() + TIME_OUT);
 
         /* could not read any more bytes */
-        if (length < 1
-            || alarm_went_off) {
+        if (length < 1) {
             return -1;
         }
 
@@ -28,7 +28,6 @@
 #include <sys/stat.h>
 #include <ctype.h>
 #include <time.h>
-#include <signal.h>
 #include <errno.h>
 #include <pwd.h>
 #include <stdarg.h>
@@ -37,7 +36,9 @@
 
 #define KEEP_SERVING 0
 #define LISTEN_PORT 80
-#define TIME_OUT 5
+#define TIME_OUT 5000000  /* usec we wait for the client at a time */
+#define BACKLOG 16       /* clients that may connect while we serve one */
+#define MAX_CLIENTS 16   /* clients whose requests we read at once */
 #define DATE_TIME_FORMAT "%a, %d %b %Y %H:%M:%S GMT"  /* as in RFC 1123 */
 #define PROTOCOL "HTTP/1.0"
 #define VERSION "Tiny httpd/1.0 ({lmbronwa,mvermaat}@cs.vu.nl)"
@@ -74,16 +75,32 @@ typedef enum {
     HEADER_CONTENT_LENGTH, HEADER_LAST_MODIFIED
 } http_header;
 
+/* a client we read the request of, or wait for to close after that */
+typedef struct client {
+    int fd;                             /* its connection */
+    char request[REQUEST_BUFFER_SIZE];
+    int request_size;
+    int header_complete;                /* how much of \r\n\r\n we saw */
+    int closing;                        /* did we answer or give up? */
+    short ready;                        /* what tcp_poll() reported */
+    tcp_u32t deadline;                  /* when we give up on it */
+} client_t;
+
 
 int serve(char *path);
 int make_absolute_path(char *path, char *absolute, int max_length);
-int get_request(char *buffer, int max_length);
+int poll_clients(void);
+int accept_client(void);
+int handle_client(client_t *client);
+int scan_request(client_t *client, int length);
+int answer_client(client_t *client);
 int parse_request(char *buffer, int buffer_length, http_method *method, char *url,
                   int url_length, char *protocol, int protocol_length);
 int parse_url(char *url, char *filename, int filename_length, char *mimetype,
               int mimetype_length);
 int write_response(http_method method, char *url, char *protocol);
 int send_buffer(void);
+int send_last_buffer(void);
 int handle_get(char *url);
 int file_name_character(int c);
 int write_data(const char *data, int length);
@@ -95,12 +112,10 @@ int write_header(http_header header, char *value);
 
 static char response_buffer[RESPONSE_BUFFER_SIZE];
 static int response_buffer_size;
-static int alarm_went_off = 0;
-
-
-static void alarm_handler(int sig) {
-    alarm_went_off = 1;
-}
+static int listener = -1;       /* made by the first serve() */
+static int connection;          /* the client we answer */
+static client_t clients[MAX_CLIENTS];
+static int client_count = 0;
 
 
 /*
@@ -148,7 +163,9 @@ int main(int argc, char** argv) {
 
 
 /*
-  Listen on LISTEN_PORT and serve clients
+  Listen on LISTEN_PORT and serve clients until one is done. The
+  requests of all clients are read as they come in; the answers go out
+  one at a time.
   Returns: 1 on success, 0 on failure
 */
 
@@ -156,87 +173,70 @@ int serve(char *path) {
 
     char absolute_path[MAX_PATH_LENGTH];
 
-    ipaddr_t saddr;
-
-    char request_buffer[REQUEST_BUFFER_SIZE];
-    int request_buffer_size = 0;
-
-    http_method method;
-    char url[URL_LENGTH];
-    char protocol[PROTOCOL_LENGTH];
-
-    response_buffer_size = 0;
-    alarm_went_off = 0;
-
-    /* open new socket, because previous connection might not be closed */
-    if (tcp_socket() != 0) {
-        return 0;
-    }
+    int acceptable, i;
 
     /*
-      If we are superuser, we can chroot for safety.
-      This has to be done after tcp_socket, because
-      it needs access to the ethernet device.
-      Note that this will be done again for each
-      connection, but that doesn't do any harm.
+      Listen only once; the next clients connect while
+      we serve this one, and wait for tcp_accept().
     */
-    if (geteuid() == 0) {
-        /* chroot doesn't accept relative paths */
-        if (!make_absolute_path(path, absolute_path, MAX_PATH_LENGTH)
-            || (chroot(absolute_path) < 0)
-            || (chdir("/") < 0)) {
+    if (listener == -1) {
+
+        listener = tcp_open();
+        if (listener == -1) {
             return 0;
         }
-    }
 
-    if (tcp_listen(LISTEN_PORT, &saddr) < 0) {
-        return 0;
-    }
+        /* returning clients may send their request with the SYN */
+        tcp_fastopen_fd(listener, 1);
+
+        /*
+          If we are superuser, we can chroot for safety.
+          This has to be done after tcp_open, because
+          it needs access to the ethernet device.
+        */
+        if (geteuid() == 0) {
+            /* chroot doesn't accept relative paths */
+            if (!make_absolute_path(path, absolute_path, MAX_PATH_LENGTH)
+                || (chroot(absolute_path) < 0)
+                || (chdir("/") < 0)) {
+                return 0;
+            }
+        }
 
-    request_buffer_size = get_request(request_buffer, REQUEST_BUFFER_SIZE);
+        if (tcp_listen_backlog(listener, LISTEN_PORT, BACKLOG) < 0) {
+            tcp_release(listener);
+            listener = -1;
+            return 0;
+        }
 
-    if (request_buffer_size < 0) {
-        tcp_close();
-        return 1;
+        /* we only wait in tcp_poll() */
+        tcp_nonblock_fd(listener, 1);
+
+        /* clients get their acks while we read a file; if the engine
+           won't start, they get them once we are back */
+        tcp_engine_start();
     }
 
-    if (parse_request(request_buffer, request_buffer_size,
-                      &method,
-                      url, URL_LENGTH,
-                      protocol, PROTOCOL_LENGTH)) {
-        if (!(write_response(method, url, protocol)
-              && send_buffer())) {
-            /*
-              Don't call tcp_close in case of error,
-              because the client may think all data
-              was sent correctly because of that.
-            */
-            return 1;
+    for (;;) {
+
+        acceptable = poll_clients();
+        if (acceptable < 0) {
+            return 0;
         }
-    } else {
-        if (!(write_error(STATUS_BAD_REQUEST)
-              && send_buffer())) {
-            /*
-              Don't call tcp_close in case of error,
-              because the client may think all data
-              was sent correctly because of that.
-            */
-            return 1;
+
+        if (acceptable && !accept_client()) {
+            return 0;
         }
-    }
 
-    /* properly close connection */
-    if (tcp_close() != 0) {
-        return 0;
+        for (i = 0; i < client_count; i++) {
+            if (handle_client(&clients[i])) {
+                tcp_release(clients[i].fd);
+                clients[i] = clients[--client_count];
+                return 1;
+            }
+        }
     }
 
-    signal(SIGALRM, alarm_handler);
-    alarm(TIME_OUT);
-    while (tcp_read(request_buffer, REQUEST_BUFFER_SIZE) > 0) {}
-    alarm(0);
-
-    return 1;
-
 }
 
 
@@ -280,73 +280,209 @@ int make_absolute_path(char *path, char *absolute, int max_length) {
 
 
 /*
-  Read request at least until entire request header is in
-  Returns: number of bytes read on success, -1 on failure
+  Waits until the listener or a client is ready, or the deadline of a
+  client passes
+  Returns: 1 if the listener has a client, 0 if not, -1 on failure
 */
 
-int get_request(char *buffer, int max_length) {
+int poll_clients(void) {
+
+    tcp_pollfd_t fds[MAX_CLIENTS + 1];
+    long timeout = -1, left;
+    int i;
+
+    fds[0].fd = listener;
+    fds[0].events = client_count < MAX_CLIENTS ? TCP_POLLACCEPT : 0;
+
+    for (i = 0; i < client_count; i++) {
+        fds[i + 1].fd = clients[i].fd;
+        fds[i + 1].events = TCP_POLLIN;
+        left = (int) (clients[i].deadline - tcp_now());
+        if (left < 0) {
+            left = 0;
+        }
+        if (timeout == -1 || left < timeout) {
+            timeout = left;
+        }
+    }
+
+    if (tcp_poll(fds, client_count + 1, timeout) < 0) {
+        return -1;
+    }
+
+    for (i = 0; i < client_count; i++) {
+        clients[i].ready = fds[i + 1].revents;
+    }
+    return fds[0].revents != 0;
+
+}
+
+
+/*
+  Takes the next client off the listener
+  Returns: 1 on success, 0 on failure
+*/
+
+int accept_client(void) {
+
+    client_t *client = &clients[client_count];
+    ipaddr_t saddr;
+
+    client->fd = tcp_accept(listener, &saddr);
+    if (client->fd < 0) {
+        /* it may have gone away again */
+        return errno == EAGAIN;
+    }
+
+    tcp_nonblock_fd(client->fd, 1);
+    client->request_size = 0;
+    client->header_complete = 0;
+    client->closing = 0;
+    client->ready = 0;
+    client->deadline = tcp_now() + TIME_OUT;
+    client_count++;
+
+    return 1;
+
+}
+
+
+/*
+  Reads what the client sent, if tcp_poll() found it ready, and
+  answers once the request header is in. After that, or if the
+  request doesn't come, we close and wait for the client to close.
+  Returns: 1 if we are done with the client, 0 otherwise
+*/
+
+int handle_client(client_t *client) {
 
     int length;
-    int total_length = 0;
-    int header_complete = 0;
 
-    /* do tcp_read until we find \r\n\r\n in buffer */
+    if (client->ready == 0) {
+        /* nothing came; give up at its deadline */
+        return (int) (tcp_now() - client->deadline) >= 0;
+    }
 
-    do {
+    if (client->closing) {
+        /* drop what else they send until they close */
+        length = tcp_read_fd(client->fd, client->request,
+                             REQUEST_BUFFER_SIZE);
+        return length == 0 || (length < 0 && errno != EAGAIN);
+    }
 
-        signal(SIGALRM, alarm_handler);
-        alarm(TIME_OUT);
-        length = tcp_read(buffer + total_length,
-                          max_length - total_length);
-        alarm(0);
+    length = tcp_read_fd(client->fd, client->request + client->request_size,
+                         REQUEST_BUFFER_SIZE - client->request_size);
+    if (length < 0 && errno == EAGAIN) {
+        return 0;
+    }
 
-        /* could not read any more bytes */
-        if (length < 1
-            || alarm_went_off) {
-            return -1;
+    /* each part of the request may take TIME_OUT */
+    client->deadline = tcp_now() + TIME_OUT;
+
+    if (length > 0 && scan_request(client, length)) {
+        if (!answer_client(client)) {
+            return 1;
         }
+    } else if (length > 0 && client->request_size < REQUEST_BUFFER_SIZE) {
+        return 0;
+    } else {
+        /* could not read any more bytes */
+        tcp_close_fd(client->fd);
+    }
 
-        /* byte by byte search for '\r' */
-        while (length > 0) {
+    /* the last buffer closed the connection; wait for the client */
+    client->closing = 1;
+    client->deadline = tcp_now() + TIME_OUT;
+    return 0;
 
-            if (buffer[total_length] == '\r') {
+}
 
-                if (header_complete == 0
-                    || header_complete == 2) {
-                    header_complete++;
-                } else {
-                    header_complete = 0;
-                }
 
-            } else if (buffer[total_length] == '\n') {
+/*
+  Looks for the end of the request header in the length bytes the
+  client just sent
+  Returns: 1 if the entire request header is in, 0 otherwise
+*/
 
-                if (header_complete == 1
-                    || header_complete == 3) {
-                    header_complete++;
-                } else {
-                    header_complete = 0;
-                }
+int scan_request(client_t *client, int length) {
 
-            } else {
+    /* byte by byte search for '\r' */
+    while (length > 0) {
 
-                header_complete = 0;
+        if (client->request[client->request_size] == '\r') {
 
+            if (client->header_complete == 0
+                || client->header_complete == 2) {
+                client->header_complete++;
+            } else {
+                client->header_complete = 0;
             }
 
-            if (header_complete == 4) {
-                break;
+        } else if (client->request[client->request_size] == '\n') {
+
+            if (client->header_complete == 1
+                || client->header_complete == 3) {
+                client->header_complete++;
+            } else {
+                client->header_complete = 0;
             }
 
-            total_length++;
-            length--;
+        } else {
+
+            client->header_complete = 0;
 
         }
 
-        total_length += length;
+        if (client->header_complete == 4) {
+            break;
+        }
+
+        client->request_size++;
+        length--;
+
+    }
+
+    client->request_size += length;
+
+    return client->header_complete == 4;
+
+}
+
 
-    } while (header_complete < 4);
+/*
+  Answers the request of the client, and closes the connection
+  Returns: 1 on success, 0 on failure
+*/
+
+int answer_client(client_t *client) {
+
+    http_method method;
+    char url[URL_LENGTH];
+    char protocol[PROTOCOL_LENGTH];
+    int ok;
+
+    connection = client->fd;
+    response_buffer_size = 0;
 
-    return total_length;
+    /* the answer waits for room in the send buffer */
+    tcp_nonblock_fd(connection, 0);
+
+    if (parse_request(client->request, client->request_size,
+                      &method,
+                      url, URL_LENGTH,
+                      protocol, PROTOCOL_LENGTH)) {
+        ok = write_response(method, url, protocol) && send_last_buffer();
+    } else {
+        ok = write_error(STATUS_BAD_REQUEST) && send_last_buffer();
+    }
+
+    /*
+      Don't call tcp_close in case of error,
+      because the client may think all data
+      was sent correctly because of that.
+    */
+    tcp_nonblock_fd(connection, 1);
+    return ok;
 
 }
 
@@ -930,7 +1066,29 @@ int write_data(const char *data, int length) {
 
 int send_buffer() {
 
-    if (tcp_write(response_buffer, response_buffer_size)
+    if (tcp_write_deadline(connection, response_buffer, response_buffer_size,
+                           tcp_now() + TIME_OUT)
+        != response_buffer_size) {
+        return 0;
+    }
+
+    response_buffer_size = 0;
+
+    return 1;
+
+}
+
+
+/*
+  Send contents of response buffer to client, and close the
+  connection; the FIN goes with the last bytes
+  Returns: 1 on success, 0 on failure
+*/
+
+int send_last_buffer() {
+
+    if (tcp_write_close_fd(connection, response_buffer, 
+                           response_buffer_size)
         != response_buffer_size) {
         return 0;
     }
@@ -0,0 +1,275 @@
+#include <string.h>
+#include "cong.h"
+
+/* CUBIC constants, RFC 9438 */
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+#define CUBIC_ALPHA (3.0 * (1.0 - CUBIC_BETA) / (1.0 + CUBIC_BETA))
+
+/* "arbitrarily high" initial slow start threshold */
+#define SSTHRESH_INITIAL 0x7fffffff
+
+
+/* Procedure prototypes */
+void reno_init(cong_t *cc);
+void reno_on_ack(cong_t *cc, tcp_u32t acked, tcp_u32t now, long srtt);
+void reno_on_loss(cong_t *cc, tcp_u32t in_flight);
+void reno_on_rto(cong_t *cc, tcp_u32t in_flight);
+void cubic_init(cong_t *cc);
+void cubic_on_ack(cong_t *cc, tcp_u32t acked, tcp_u32t now, long srtt);
+void cubic_on_loss(cong_t *cc, tcp_u32t in_flight);
+void cubic_on_rto(cong_t *cc, tcp_u32t in_flight);
+void cubic_reduce(cong_t *cc);
+tcp_u32t cong_cwnd(cong_t *cc);
+tcp_u32t cong_ssthresh(cong_t *cc);
+void slow_start(cong_t *cc, tcp_u32t acked);
+tcp_u32t initial_window(tcp_u32t mss);
+double cube_root(double x);
+
+int min(int x, int y);
+int max(int x, int y);
+
+
+const cong_ops_t cong_reno = {
+    "reno",
+    reno_init,
+    reno_on_ack,
+    reno_on_loss,
+    reno_on_rto,
+    cong_cwnd,
+    cong_ssthresh
+};
+
+const cong_ops_t cong_cubic = {
+    "cubic",
+    cubic_init,
+    cubic_on_ack,
+    cubic_on_loss,
+    cubic_on_rto,
+    cong_cwnd,
+    cong_ssthresh
+};
+
+static const cong_ops_t *algorithms[] = {
+    &cong_reno,
+    &cong_cubic,
+    NULL
+};
+
+
+
+/* Returns the algorithm called name, or NULL if there is none */
+
+const cong_ops_t *cong_find(const char *name) {
+
+    int i;
+
+    for (i = 0; algorithms[i]; i++) {
+        if (!strcmp(algorithms[i]->name, name)) {
+            return algorithms[i];
+        }
+    }
+    return NULL;
+}
+
+
+
+/* Resets cc for a new connection, using Reno if ops is NULL */
+
+void cong_init(cong_t *cc, const cong_ops_t *ops, tcp_u32t mss) {
+
+    memset(cc, 0, sizeof(cong_t));
+    cc->ops = ops ? ops : &cong_reno;
+    cc->mss = mss;
+    cc->ops->init(cc);
+}
+
+
+
+/* ----------------------------------- */
+/*                 RENO                */
+/* ----------------------------------- */
+
+
+void reno_init(cong_t *cc) {
+    cc->cwnd = initial_window(cc->mss);
+    cc->ssthresh = SSTHRESH_INITIAL;
+}
+
+
+/* slow start, then one segment per window of acked bytes (RFC 5681) */
+
+void reno_on_ack(cong_t *cc, tcp_u32t acked, tcp_u32t now, long srtt) {
+
+    if (cc->cwnd < cc->ssthresh) {
+        slow_start(cc, acked);
+        return;
+    }
+
+    cc->bytes_acked += acked;
+    if (cc->bytes_acked >= cc->cwnd) {
+        cc->bytes_acked -= cc->cwnd;
+        cc->cwnd += cc->mss;
+    }
+}
+
+
+void reno_on_loss(cong_t *cc, tcp_u32t in_flight) {
+    cc->ssthresh = max(in_flight / 2, 2 * cc->mss);
+    cc->cwnd = cc->ssthresh;
+    cc->bytes_acked = 0;
+}
+
+
+void reno_on_rto(cong_t *cc, tcp_u32t in_flight) {
+    cc->ssthresh = max(in_flight / 2, 2 * cc->mss);
+    cc->cwnd = cc->mss;
+    cc->bytes_acked = 0;
+}
+
+
+
+/* ----------------------------------- */
+/*                CUBIC                */
+/* ----------------------------------- */
+
+
+void cubic_init(cong_t *cc) {
+    cc->cwnd = initial_window(cc->mss);
+    cc->ssthresh = SSTHRESH_INITIAL;
+    cc->epoch_valid = 0;
+    cc->w_max = 0;
+}
+
+
+/*
+    Grows cwnd towards W(t) = C * (t - K)^3 + origin (RFC 9438), where t
+    is the time since the last reduction, but never slower than Reno.
+*/
+
+void cubic_on_ack(cong_t *cc, tcp_u32t acked, tcp_u32t now, long srtt) {
+
+    double t, target, mss, cwnd;
+
+    if (cc->cwnd < cc->ssthresh) {
+        slow_start(cc, acked);
+        return;
+    }
+
+    mss = cc->mss;
+    cwnd = cc->cwnd;
+
+    if (!cc->epoch_valid) {
+        cc->epoch_valid = 1;
+        cc->epoch_start = now;
+        if (cwnd < cc->w_max) {
+            cc->k = cube_root((cc->w_max - cwnd) / mss / CUBIC_C);
+            cc->origin = cc->w_max;
+        } else {
+            cc->k = 0;
+            cc->origin = cwnd;
+        }
+        cc->w_est = cwnd;
+    }
+
+    /* where the cubic will be one round trip from now */
+    t = (double) (tcp_u32t) (now - cc->epoch_start + srtt) / 1000000.0;
+    target = cc->origin + CUBIC_C * (t - cc->k) * (t - cc->k) * (t - cc->k)
+                            * mss;
+
+    /* don't grow by more than half a window per round trip */
+    if (target > 1.5 * cwnd) {
+        target = 1.5 * cwnd;
+    }
+    if (target > cwnd) {
+        cwnd += (target - cwnd) * acked / cwnd;
+    }
+
+    /* Reno friendly region */
+    cc->w_est += CUBIC_ALPHA * mss * acked / cc->cwnd;
+    if (cc->w_est > cwnd) {
+        cwnd = cc->w_est;
+    }
+
+    cc->cwnd = (tcp_u32t) cwnd;
+}
+
+
+void cubic_on_loss(cong_t *cc, tcp_u32t in_flight) {
+    cubic_reduce(cc);
+    cc->cwnd = cc->ssthresh;
+}
+
+
+void cubic_on_rto(cong_t *cc, tcp_u32t in_flight) {
+    cubic_reduce(cc);
+    cc->cwnd = cc->mss;
+}
+
+
+/* Multiplicative decrease by CUBIC_BETA, with fast convergence */
+
+void cubic_reduce(cong_t *cc) {
+
+    double cwnd = cc->cwnd;
+
+    if (cwnd < cc->w_max) {
+        /* we lost before reaching the old plateau; release bandwidth */
+        cc->w_max = cwnd * (1.0 + CUBIC_BETA) / 2.0;
+    } else {
+        cc->w_max = cwnd;
+    }
+
+    cc->ssthresh = max((int) (cwnd * CUBIC_BETA), 2 * cc->mss);
+    cc->epoch_valid = 0;
+}
+
+
+
+/* ----------------------------------- */
+/*               SHARED                */
+/* ----------------------------------- */
+
+
+tcp_u32t cong_cwnd(cong_t *cc) {
+    return cc->cwnd;
+}
+
+
+tcp_u32t cong_ssthresh(cong_t *cc) {
+    return cc->ssthresh;
+}
+
+
+/* one segment per acked segment; an ack may cover two when the other
+   side delays its acks (RFC 3465) */
+
+void slow_start(cong_t *cc, tcp_u32t acked) {
+    cc->cwnd += min(acked, 2 * cc->mss);
+}
+
+
+/* initial window as in RFC 3390 */
+
+tcp_u32t initial_window(tcp_u32t mss) {
+    return min(4 * mss, max(2 * mss, 4380));
+}
+
+
+/* Newton's method, so we don't need libm */
+
+double cube_root(double x) {
+
+    double r;
+    int i;
+
+    if (x <= 0) {
+        return 0;
+    }
+
+    r = x > 1 ? x : 1;
+    for (i = 0; i < 100; i++) {
+        r = (2 * r + x / (r * r)) / 3;
+    }
+    return r;
+}
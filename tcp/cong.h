@@ -0,0 +1,54 @@
+#ifndef __CONG_H__
+#define __CONG_H__
+
+#include "tcp.h"
+
+
+/* Congestion control state of one connection. Windows are in bytes. */
+typedef struct cong {
+    const struct cong_ops *ops; /* algorithm in use */
+    tcp_u32t mss;           /* segment size the windows are counted in */
+    tcp_u32t cwnd;          /* congestion window */
+    tcp_u32t ssthresh;      /* slow start threshold */
+    tcp_u32t bytes_acked;   /* acked bytes towards the next cwnd increase */
+
+    /* CUBIC only */
+    int epoch_valid;        /* is a congestion avoidance epoch running? */
+    tcp_u32t epoch_start;   /* when it started, see tcp_now() */
+    double w_max;           /* cwnd just before the last reduction */
+    double k;               /* seconds until the cubic reaches origin */
+    double origin;          /* plateau of the cubic function */
+    double w_est;           /* what Reno would have by now */
+} cong_t;
+
+
+/* A congestion control algorithm */
+typedef struct cong_ops {
+    const char *name;
+
+    /* start of a connection */
+    void (*init)(cong_t *cc);
+
+    /* acked bytes of new data, outside of fast recovery;
+       now and srtt are in microseconds */
+    void (*on_ack)(cong_t *cc, tcp_u32t acked, tcp_u32t now, long srtt);
+
+    /* loss detected by duplicate acks, entering fast recovery */
+    void (*on_loss)(cong_t *cc, tcp_u32t in_flight);
+
+    /* retransmission time out */
+    void (*on_rto)(cong_t *cc, tcp_u32t in_flight);
+
+    tcp_u32t (*cwnd)(cong_t *cc);
+    tcp_u32t (*ssthresh)(cong_t *cc);
+} cong_ops_t;
+
+
+extern const cong_ops_t cong_reno;
+extern const cong_ops_t cong_cubic;
+
+const cong_ops_t *cong_find(const char *name);
+void cong_init(cong_t *cc, const cong_ops_t *ops, tcp_u32t mss);
+
+
+#endif /* __CONG_H__ */
@@ -1,7 +1,13 @@
 #include <stdio.h>
 #include <signal.h>
+#include <errno.h>
 #include <assert.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include "tcp.h"
+#include "cong.h"
 #include "unistd.h"
 
 #define FIN_FLAG 0x01
@@ -11,6 +17,35 @@
 #define ACK_FLAG 0x10
 #define URG_FLAG 0x20
 
+/* TCP options */
+#define OPT_EOL 0
+#define OPT_NOP 1
+#define OPT_MSS 2
+#define OPT_WSCALE 3
+#define OPT_SACK_PERMITTED 4
+#define OPT_SACK 5
+#define OPT_TIMESTAMP 8
+#define OPT_FASTOPEN 34
+
+/* TCP Fast Open (RFC 7413) */
+#define TFO_COOKIE_LEN 8    /* the cookies we give out */
+#define TFO_COOKIE_MIN 4    /* shortest cookie we take */
+#define TFO_CACHE_SIZE 8    /* servers we remember a cookie of */
+
+/* sequence number comparison, modulo 2^32 */
+#define SEQ_LT(a, b) ((int) ((a) - (b)) < 0)
+#define SEQ_LEQ(a, b) ((int) ((a) - (b)) <= 0)
+
+/* the timer wheel: WHEEL_LEVELS levels of WHEEL_SLOTS slots, where one
+   slot of a level spans all the slots of the level below it */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+/* receiver side silly window avoidance: only move the right edge of our
+   window by at least this many bytes */
+#define RCV_SWS_THRESHOLD (min(tcb->rcv_buf_size / 2, tcb->rcv_mss))
+
 
 /* States */
 typedef enum{
@@ -23,31 +58,268 @@ typedef enum{
 typedef enum {
     E_SOCKET_OPEN, E_CONNECT, E_SYN_SENT, E_SYN_ACK_RECEIVED, E_LISTEN,
     E_SYN_RECEIVED, E_SYN_ACK_SENT, E_ACK_RECEIVED, E_ACK_TIME_OUT, E_CLOSE, 
-    E_PARTNER_DEAD, E_FIN_RECEIVED
+    E_PARTNER_DEAD, E_FIN_RECEIVED, E_ACCEPTED
 } event_t;
 
+/* Range of out of order data [start, end) stored in the receive buffer,
+    or a range they told us they have (SACK) */
+typedef struct ooo_block {
+    tcp_u32t start;
+    tcp_u32t end;
+} ooo_block_t;
+
+/* A segment in flight, in the retransmission queue. Its bytes stay in
+    the send buffer until they are acked, and are resent from there. */
+typedef struct rtx_seg {
+    tcp_u32t seq;           /* seq nr of its first byte */
+    tcp_u32t time;          /* when it was last sent, see tcp_now() */
+    tcp_u16t len;           /* its nr of seq nrs, FIN included */
+    tcp_u8t retransmits;    /* times it was sent again */
+    tcp_u8t sacked;         /* did they ack or SACK it? */
+    tcp_u8t lost;           /* do we think so, and didn't resend it yet? */
+} rtx_seg_t;
+
+/* What goes off when no ack comes for what we sent */
+typedef enum {
+    T_NONE, T_RTO, T_PROBE, T_REORDER, T_PERSIST
+} send_timer_t;
+
+/* A timer on the timer wheel, see run_timers() */
+typedef struct tcp_timer {
+    struct tcp_timer *next;   /* in its slot of the wheel */
+    struct tcp_timer **pprev; /* what points to it, NULL if it doesn't run */
+    tcp_u32t expires;         /* tick it goes off, see wheel_ticks() */
+    struct tcb *conn;         /* the connection it works on, or NULL */
+    void (*expire)(void);     /* what it does then, on tcb = conn */
+} tcp_timer_t;
+
+/* Options found in a received segment */
+typedef struct tcp_options {
+    int mss;                /* 0 if they sent none */
+    int wscale_ok;          /* did they send a window scale? */
+    int wscale;             /* its shift count */
+    int sack_permitted;
+    int sack_count;
+    ooo_block_t sack[MAX_SACK_BLOCKS];
+    int ts_ok;              /* did they send a timestamp? */
+    tcp_u32t tsval;         /* their clock when they sent it */
+    tcp_u32t tsecr;         /* the timestamp of ours they echo */
+    int tfo_ok;             /* did they send a Fast Open option? */
+    int tfo_cookie_len;     /* 0 if it asks for a cookie */
+    char tfo_cookie[TFO_COOKIE_MAX];
+} tcp_options_t;
+
+/* A Fast Open cookie we got from a server */
+typedef struct tfo_entry {
+    ipaddr_t ipaddr;        /* the server, 0 if the entry is free */
+    int mss;                /* the data that fits in our SYN */
+    int cookie_len;
+    char cookie[TFO_COOKIE_MAX];
+} tfo_entry_t;
+
+/* A SYN in the backlog of a listener, that we answered with a SYN-ACK
+    of which the ack didn't come yet */
+typedef struct syn_entry {
+    ipaddr_t their_ipaddr;
+    tcp_u16t their_port;    /* 0 if the entry is free */
+    tcp_u32t irs;           /* seq nr of their SYN */
+    tcp_u32t iss;           /* seq nr of our SYN-ACK */
+    tcp_u32t snd_wnd;       /* window in their SYN */
+    tcp_u32t ts_recent;     /* their timestamp, if ts_ok */
+    tcp_u32t time;          /* when we last sent our SYN-ACK */
+    tcp_u16t mss;           /* largest segment we send them */
+    tcp_u8t wscale;         /* their window shift, if wscale_ok */
+    tcp_u8t wscale_ok;
+    tcp_u8t sack_ok;
+    tcp_u8t ts_ok;
+    tcp_u8t tfo_cookie;     /* do they want a Fast Open cookie? */
+    tcp_u8t retransmits;    /* times we resent our SYN-ACK */
+} syn_entry_t;
+
+/* The backlog of a listener, see tcp_listen_backlog() */
+typedef struct listener {
+    int backlog;            /* most entries in syn and in accepted */
+    syn_entry_t syn[SYN_BACKLOG_MAX]; /* half open connections */
+    int syn_count;          /* nr of entries in use in syn */
+    int accepted[SYN_BACKLOG_MAX]; /* circular, descriptors for tcp_accept() */
+    int accept_head;        /* index of the oldest one */
+    int accept_count;       /* nr of descriptors in accepted */
+} listener_t;
+
+/* A packet the receiver thread took, see start_receiver() */
+typedef struct rx_packet {
+    ipaddr_t src;
+    ipaddr_t dst;
+    tcp_u16t proto;
+    tcp_u16t id;
+    char *data;             /* from ip_receive(), ours to free */
+    int len;                /* what ip_receive() returned */
+} rx_packet_t;
+
 /* Procedure prototypes */
-int send_data(const char *buf, int len);
+int buffer_data(const char *buf, int len, int fin);
+void push_data(void);
+const char *buffered_bytes(int offset, int len, char *scratch);
+void release_acked(tcp_u32t ack_nr);
+int send_buffered(int left);
+int send_window(int override_sws);
+int send_probe(void);
+send_timer_t send_timer(long *timeout);
+int send_timeout(send_timer_t timer);
+int send_tlp(void);
+long probe_timeout(void);
+void tlp_ack(tcp_u32t ack_nr, int dupack);
+int send_segment(tcp_u32t seq_nr, tcp_u8t flags, const char *data,
+                 int data_sz);
+int retransmit_segment(rtx_seg_t *seg);
+int retransmit_hole(void);
+rtx_seg_t *rtx_seg(int i);
+int rtx_find(tcp_u32t seq_nr);
+void note_sent(tcp_u32t start, tcp_u32t end);
+void forget_sent(tcp_u32t ack_nr);
+int rack_update(tcp_u32t ack_nr);
+int rack_detect_loss(void);
+void rack_recover(void);
+long reorder_window(void);
+int sent_after(tcp_u32t time1, tcp_u32t end1, tcp_u32t time2, tcp_u32t end2);
+int carries_fin(int offset, int data_sz);
 int send_syn(void);
 int send_ack(void);
-int send_fin(void);
 void do_packet(void);
-void handle_ack(tcp_u8t flags, tcp_u32t ack_nr);
+void handle_ack(tcp_u8t flags, tcp_u32t seq_nr, tcp_u32t ack_nr,
+                tcp_u16t win_sz, int data_sz, tcp_options_t *opts);
 void handle_data(tcp_u8t flags, tcp_u32t seq_nr, char *data, int data_size);
-void handle_syn(tcp_u8t flags, tcp_u32t seq_nr, ipaddr_t their_ip);
-void handle_fin(tcp_u8t flags, tcp_u32t seq_nr);
+void copy_to_buffer(int offset, char *data, int size);
+int add_block(ooo_block_t *blocks, int *count, 
+              tcp_u32t start, tcp_u32t end);
+int merge_ooo_blocks(void);
+void handle_sack(tcp_options_t *opts);
+void handle_syn(tcp_u8t flags, tcp_u32t seq_nr, tcp_u16t win_sz,
+                tcp_options_t *opts, ipaddr_t their_ip,
+                char *data, int data_sz);
+int fastopen_data(tcp_options_t *opts, ipaddr_t their_ip, int data_sz);
+void fastopen_make_cookie(ipaddr_t ipaddr, char *cookie);
+tfo_entry_t *fastopen_entry(ipaddr_t ipaddr, int create);
+tcp_u32t mix32(tcp_u32t x);
+void handle_fin(tcp_u8t flags, tcp_u32t seq_nr, int data_sz);
+void negotiate_mss(tcp_options_t *opts);
+void negotiate_wscale(tcp_options_t *opts);
+int wscale_for(int size);
 void declare_event(event_t e);
 void clear_tcb(void);
-int wait_for_ack(void);
-int all_acks_received(void);
+int use_tcb(int fd);
+int alloc_tcb(int fd);
+int conn_bucket(tcp_u16t our_port, ipaddr_t their_ip, tcp_u16t their_port);
+void rehash_tcb(void);
+int free_fd(void);
+void stop_listening(void);
+syn_entry_t *find_syn_entry(ipaddr_t their_ip, tcp_u16t their_port);
+tcp_u32t backlog_iss(ipaddr_t their_ip, tcp_u16t their_port);
+void load_syn_entry(syn_entry_t *entry);
+int send_syn_entry(syn_entry_t *entry);
+void resend_syn_acks(void);
+long syn_ack_timeout(void);
+long syn_entry_timeout(syn_entry_t *entry);
+void queue_accepted(listener_t *l, int fd);
+int fastopen_accept(void);
+int wait_for_ack(long timeout);
+int resend_syn_ack(void);
+void rtt_start(tcp_u32t seq_nr);
+void rtt_sample(tcp_u32t ack_nr);
+void rtt_update(long rtt);
+int rtt_stale(long rtt);
+int paws_reject(tcp_u8t flags, tcp_u32t seq_nr, int data_sz,
+                tcp_options_t *opts);
+tcp_u32t ts_now(void);
+void rto_backoff(void);
+void timer_start(tcp_timer_t *t, long usec);
+void timer_stop(tcp_timer_t *t);
+int run_timers(void);
+void arm_timers(void);
+void rtx_expire(void);
+void ack_expire(void);
+void wait_expire(void);
+void deadline_start(tcp_u32t deadline);
+void deadline_stop(void);
+void deadline_expire(void);
+int interrupted(void);
+void wheel_insert(tcp_timer_t *t);
+int wheel_cascade(int level);
+tcp_u32t wheel_next(void);
+tcp_u32t wheel_ticks(void);
+int start_receiver(void);
+void *receive_packets(void *arg);
+int receive_ip(ipaddr_t *src, ipaddr_t *dst, tcp_u16t *proto, tcp_u16t *id,
+               char **data);
+int rx_pending(void);
+void wait_for_packet(void);
+int timers_due(void);
+void timer_due(union sigval value);
+void arm_event_timer(void);
+void *run_engine(void *arg);
+void engine_lock(void);
+void engine_unlock(void);
+void notify(int fd);
 void ack_these_bytes(int bytes_delivered);
 int packet_is_valid(tcp_u32t seq_nr, tcp_u32t ack_nr, tcp_u8t flags,
                     tcp_u16t src_port, tcp_u16t dst_port, int data_sz);
+int build_options(tcp_u8t flags, char *options);
+int build_sack_option(char *options, int space);
+int build_timestamp_option(char *options, tcp_u8t flags);
+int build_fastopen_option(char *options);
+void parse_options(const char *options, int len, tcp_options_t *opts);
+void put_u32(char *p, tcp_u32t value);
+tcp_u32t get_u32(const char *p);
 
 tcp_u16t tcp_checksum(ipaddr_t src, ipaddr_t dst, void *segment, int len);
 void tcp_alarm(int sig);
+void restore_alarm(void (*oldsig)(int));
+int listen_for(int fd, int port, ipaddr_t *src);
+int read_data(int fd, char *buf, int maxlen);
+
+/* the calls of tcp.h without the stack lock, see tcp_engine_start() */
+int tcp_socket_fd_unlocked(int fd);
+int tcp_open_unlocked(void);
+int tcp_release_unlocked(int fd);
+int tcp_connect_fd_unlocked(int fd, ipaddr_t dst, int port);
+int tcp_connect_write_fd_unlocked(int fd, ipaddr_t dst, int port,
+                                  const char *buf, int len);
+int tcp_listen_fd_unlocked(int fd, int port, ipaddr_t *src);
+int tcp_listen_deadline_unlocked(int fd, int port, ipaddr_t *src,
+                                 tcp_u32t deadline);
+int tcp_listen_backlog_unlocked(int fd, int port, int backlog);
+int tcp_accept_unlocked(int fd, ipaddr_t *src);
+int tcp_close_fd_unlocked(int fd);
+int tcp_read_fd_unlocked(int fd, char *buf, int maxlen);
+int tcp_read_deadline_unlocked(int fd, char *buf, int maxlen,
+                               tcp_u32t deadline);
+int tcp_write_fd_unlocked(int fd, const char *buf, int len);
+int tcp_write_deadline_unlocked(int fd, const char *buf, int len,
+                                tcp_u32t deadline);
+int tcp_write_close_fd_unlocked(int fd, const char *buf, int len);
+int tcp_cork_fd_unlocked(int fd, int on);
+int tcp_flush_fd_unlocked(int fd);
+int tcp_nodelay_fd_unlocked(int fd, int on);
+int tcp_nonblock_fd_unlocked(int fd, int on);
+int tcp_poll_unlocked(tcp_pollfd_t *fds, int nfds, long timeout);
+int tcp_process_events_unlocked(void);
+long tcp_rto_fd_unlocked(int fd);
+int tcp_congestion_fd_unlocked(int fd, const char *name);
+int tcp_mss_fd_unlocked(int fd);
+int tcp_sack_fd_unlocked(int fd);
+int tcp_set_mss_fd_unlocked(int fd, int mss);
+int tcp_set_rcvbuf_fd_unlocked(int fd, int size);
+int tcp_set_sndbuf_fd_unlocked(int fd, int size);
+int tcp_fastopen_fd_unlocked(int fd, int on);
+int tcp_fastopen_cookie_unlocked(ipaddr_t dst, char *cookie);
+int tcp_set_fastopen_cookie_unlocked(ipaddr_t dst, const char *cookie,
+                                     int len);
+int poll_ready(tcp_pollfd_t *fds, int nfds);
+short poll_events(void);
 void receive_new_data(int maxlen);
 int deliver_received_bytes(char *buf, int maxlen);
+tcp_u32t receive_window(void);
+tcp_u16t advertise_window(tcp_u8t flags);
 
 int min(int x, int y);
 int max(int x, int y);
@@ -55,25 +327,115 @@ int max(int x, int y);
 
 /* TCP control block */
 typedef struct tcb {
+    int fd;                 /* its descriptor, see tcp_open() */
+    int hash_bucket;        /* where in conn_hash it is, -1 if not */
+    struct tcb *hash_next;  /* next in that bucket */
+    listener_t *listener;   /* NULL, but see tcp_listen_backlog() */
     ipaddr_t our_ipaddr;
     ipaddr_t their_ipaddr;
     tcp_u16t our_port;
     tcp_u16t their_port;
-    tcp_u32t our_seq_nr;
+    tcp_u32t our_seq_nr;    /* first byte not yet acked by them */
     tcp_u32t their_seq_nr;  /* last byte we acked */
     tcp_u32t ack_nr;        /* the seq nr to ack in next packet */
-    tcp_u32t expected_ack;  
-    char rcv_data[BUFFER_SIZE];
+    tcp_u32t expected_ack;  /* one past the highest byte we transmitted */
+    tcp_u32t snd_nxt;       /* seq nr of next byte to transmit */
+    tcp_u32t snd_wnd;       /* window advertised by them */
+    tcp_u32t max_snd_wnd;   /* largest window they ever advertised */
+    tcp_u32t snd_wl1;       /* seq nr of segment last used to update snd_wnd */
+    tcp_u32t snd_wl2;       /* ack nr of segment last used to update snd_wnd */
+    tcp_u32t rcv_adv;       /* right edge of the window we advertised */
+    int mss;                /* largest segment we send, from their MSS */
+    int rcv_mss;            /* largest segment we accept, our MSS */
+    int wscale_ok;          /* did we both agree on window scaling? */
+    int snd_wscale;         /* shift of the windows they advertise */
+    int rcv_wscale;         /* shift of the windows we advertise */
+    int ts_ok;              /* did we both agree on timestamps? */
+    tcp_u32t ts_recent;     /* their timestamp we echo */
+    tcp_u32t last_ack_sent; /* ack nr in the last segment we sent */
+    long srtt;              /* smoothed round trip time (usec) */
+    int rtt_valid;          /* do srtt and rttvar hold a sample yet? */
+    long rttvar;            /* round trip time variation (usec) */
+    long rto;               /* retransmission time out (usec) */
+    int rtt_timing;         /* is a segment being timed? */
+    tcp_u32t rtt_seq;       /* seq nr of the segment being timed */
+    tcp_u32t rtt_time;      /* when it was sent, see tcp_now() */
+    int dupacks;            /* nr of duplicate acks in a row */
+    tcp_u32t acks_rcvd;     /* nr of acks we handled */
+    int probed;             /* did we probe their window since a sample? */
+    tcp_u32t probe_ts;      /* timestamp of our last window probe */
+    int in_recovery;        /* are we in fast recovery? */
+    tcp_u32t recover;       /* highest byte sent when recovery started */
+    int rto_recovery;       /* resending after a time out, until recover */
+    cong_t cc;              /* congestion control */
+    tcp_u32t cwnd_inflation; /* extra window during fast recovery */
+    char *snd_data;         /* circular send buffer */
+    int snd_buf_size;       /* size of snd_data */
+    int snd_data_start;     /* pointer to start of circular buffer */
+    tcp_u32t snd_data_seq;  /* seq nr of the byte at snd_data_start */
+    int snd_data_len;       /* nr of bytes in buffer, sent or not */
+    tcp_u32t snd_psh;       /* end of the data we may not hold back */
+    int snd_fin;            /* does a FIN follow the buffered data? */
+    tcp_u32t snd_timer_base; /* when the send timers started, see tcp_now() */
+    int snd_retries;        /* time outs in a row without any ack */
+    int probes;             /* window probes since their window closed */
+    int timed_out;          /* did we give up on them, see send_timeout() */
+    tcp_timer_t rtx_timer;  /* runs the send timers, see arm_timers() */
+    tcp_u32t snd_sml;       /* end of the last small segment we sent */
+    int nodelay;            /* don't hold back small segments (Nagle) */
+    int corked;             /* hold back writes until segments are full */
+    int nonblock;           /* calls don't wait, see tcp_nonblock() */
+    char *rcv_data;         /* circular receive buffer */
+    int rcv_buf_size;       /* size of rcv_data */
     int rcvd_data_start;    /* pointer to start of circular buffer */
     int rcvd_data_size;     /* nr of bytes in buffer */
     int rcvd_data_psh;      /* number of bytes to push, (from start of buffer)*/
-    char *unacked_data;     /* transmitted data yet to be acked (or resent) */
-    int unacked_data_len;   /* length of transmitted data yet to be acked */
+    ooo_block_t ooo[MAX_OOO_BLOCKS]; /* data after a gap, sorted by seq nr */
+    int ooo_count;          /* nr of blocks in ooo */
+    tcp_u32t ooo_last;      /* seq nr of the last out of order segment */
+    int ack_pending;        /* bytes received that we didn't ack yet */
+    tcp_u32t ack_time;      /* when the first of them arrived */
+    tcp_timer_t ack_timer;  /* sends that ack ACK_DELAY later */
+    int data_follows;       /* let our first data ack their SYN */
+    tcp_u32t iss;           /* seq nr of our SYN */
+    int syn_unacked;        /* we sent data before they acked our SYN */
+    int fastopen;           /* TCP Fast Open, see tcp_fastopen() */
+    const char *syn_data;   /* data that goes in our SYN */
+    int syn_data_len;       /* length of syn_data */
+    char tfo_cookie[TFO_COOKIE_MAX]; /* cookie in our SYN or SYN-ACK */
+    int tfo_cookie_len;     /* 0 if we have none to send */
+    int sack_ok;            /* did we both agree on SACK? */
+    ooo_block_t sacked[MAX_OOO_BLOCKS]; /* scoreboard: what they have */
+    int sacked_count;       /* nr of blocks in sacked */
+    tcp_u32t rexmit_nxt;    /* holes before this were resent in recovery */
+    tcp_u32t rack_time;     /* send time of the latest segment they got */
+    tcp_u32t rack_end;      /* its end, orders segments sent at once */
+    long rack_rtt;          /* its round trip time (usec) */
+    long min_rtt;           /* smallest of those, RTO_MAX if none yet */
+    tcp_u32t rack_fack;     /* end of the highest segment they got */
+    int reordering_seen;    /* did a segment arrive after a later one? */
+    int reorder_armed;      /* does the reorder timer run? */
+    tcp_u32t reorder_time;  /* when it goes off, see tcp_now() */
+    int tlp_pending;        /* was a tail loss probe not answered yet? */
+    int tlp_retrans;        /* did it resend a segment? */
+    tcp_u32t tlp_high_seq;  /* expected_ack when we sent it */
+    rtx_seg_t rtx_queue[RTX_QUEUE_SIZE]; /* circular, sorted by seq nr */
+    int rtx_head;           /* index of the first unacked segment */
+    int rtx_count;          /* nr of segments in rtx_queue */
     state_t state;          /* stores the current state of the connection */
     tcp_u32t their_previous_seq_nr; /* to detect duplicate packets */
     tcp_u8t their_previous_flags;   /* to detect duplicate packets */
 } tcb_t;
 
+tcb_t *find_tcb(tcp_u16t our_port, ipaddr_t their_ip, tcp_u16t their_port,
+                tcp_u8t flags);
+tcb_t *handle_backlog(tcp_u8t flags, tcp_u32t seq_nr, tcp_u32t ack_nr,
+                      tcp_u16t win_sz, tcp_options_t *opts,
+                      ipaddr_t their_ip, tcp_u16t their_port,
+                      char *data, int data_sz);
+tcb_t *new_connection(void);
+tcb_t *accept_syn_entry(syn_entry_t *entry);
+
 /* Pseudo header */
 typedef struct pseudo_header {
      ipaddr_t src;
@@ -96,6 +458,10 @@ typedef struct tcp_header {
     tcp_u16t urg_pointer;
 } tcp_hdr_t;
 
+/* the options follow at TCP_HDR on the wire; fails to compile if the
+   struct doesn't match, e.g. if tcp_u32t isn't 32 bits */
+typedef char tcp_hdr_size_check[sizeof(tcp_hdr_t) == TCP_HDR ? 1 : -1];
+
 /* TCP segment header */
 typedef struct seg_header {
     pseudo_hdr_t pseudo_header;
@@ -105,7 +471,11 @@ typedef struct seg_header {
 
 typedef struct segment segment_t;
 
-static tcb_t tcb = {
+static const tcb_t tcb_defaults = {
+    0,       /* fd                */
+    -1,      /* hash_bucket       */
+    NULL,    /* hash_next         */
+    NULL,    /* listener          */
     0,       /* out_ipaddr        */
     0,       /* their_ipaddr      */
     0,       /* our_port          */
@@ -114,19 +484,154 @@ static tcb_t tcb = {
     0,       /* their_seq_nr      */
     0,       /* ack_nr            */
     0,       /* expected_ack      */
-    "",      /* rcv_data          */
+    0,       /* snd_nxt           */
+    0,       /* snd_wnd           */
+    0,       /* max_snd_wnd       */
+    0,       /* snd_wl1           */
+    0,       /* snd_wl2           */
+    0,       /* rcv_adv           */
+    DEFAULT_MSS, /* mss           */
+    MAX_TCP_DATA, /* rcv_mss      */
+    0,       /* wscale_ok         */
+    0,       /* snd_wscale        */
+    0,       /* rcv_wscale        */
+    0,       /* ts_ok             */
+    0,       /* ts_recent         */
+    0,       /* last_ack_sent     */
+    0,       /* srtt              */
+    0,       /* rtt_valid         */
+    0,       /* rttvar            */
+    RTO_INITIAL, /* rto           */
+    0,       /* rtt_timing        */
+    0,       /* rtt_seq           */
+    0,       /* rtt_time          */
+    0,       /* dupacks           */
+    0,       /* acks_rcvd         */
+    0,       /* probed            */
+    0,       /* probe_ts          */
+    0,       /* in_recovery       */
+    0,       /* recover           */
+    0,       /* rto_recovery      */
+    { NULL },/* cc                */
+    0,       /* cwnd_inflation    */
+    NULL,    /* snd_data          */
+    BUFFER_SIZE, /* snd_buf_size  */
+    0,       /* snd_data_start    */
+    0,       /* snd_data_seq      */
+    0,       /* snd_data_len      */
+    0,       /* snd_psh           */
+    0,       /* snd_fin           */
+    0,       /* snd_timer_base    */
+    0,       /* snd_retries       */
+    0,       /* probes            */
+    0,       /* timed_out         */
+    {NULL, NULL, 0, NULL, rtx_expire}, /* rtx_timer */
+    0,       /* snd_sml           */
+    0,       /* nodelay           */
+    0,       /* corked            */
+    0,       /* nonblock          */
+    NULL,    /* rcv_data          */
+    BUFFER_SIZE, /* rcv_buf_size  */
     0,       /* rcvd_data_start   */
     0,       /* rcvd_data_size    */
     0,       /* rcvd_data_psh     */
-    "",      /* unacked_data      */
-    0,       /* unacked_data_len  */
+    {{0, 0}},/* ooo               */
+    0,       /* ooo_count         */
+    0,       /* ooo_last          */
+    0,       /* ack_pending       */
+    0,       /* ack_time          */
+    {NULL, NULL, 0, NULL, ack_expire}, /* ack_timer */
+    0,       /* data_follows      */
+    0,       /* iss               */
+    0,       /* syn_unacked       */
+    0,       /* fastopen          */
+    NULL,    /* syn_data          */
+    0,       /* syn_data_len      */
+    "",      /* tfo_cookie        */
+    0,       /* tfo_cookie_len    */
+    0,       /* sack_ok           */
+    {{0, 0}},/* sacked            */
+    0,       /* sacked_count      */
+    0,       /* rexmit_nxt        */
+    0,       /* rack_time         */
+    0,       /* rack_end          */
+    0,       /* rack_rtt          */
+    RTO_MAX, /* min_rtt           */
+    0,       /* rack_fack         */
+    0,       /* reordering_seen   */
+    0,       /* reorder_armed     */
+    0,       /* reorder_time      */
+    0,       /* tlp_pending       */
+    0,       /* tlp_retrans       */
+    0,       /* tlp_high_seq      */
+    {{0, 0, 0, 0, 0, 0}}, /* rtx_queue */
+    0,       /* rtx_head          */
+    0,       /* rtx_count         */
     S_START, /* state             */
     0,       /* their_previous_seq_nr */
     0,       /* their_previous_flags */
 };
 
+/* connections by descriptor; tcp_socket() and the other calls without
+   a descriptor use 0 */
+static tcb_t *conns[MAX_CONNECTIONS];
+/* connections by 4-tuple, for do_packet() */
+static tcb_t *conn_hash[CONN_HASH_SIZE];
+/* the connection we work on */
+static tcb_t *tcb = NULL;
+
 static int alarm_went_off = 0; 
 
+/* the timer wheel; each slot is a list of timers */
+static tcp_timer_t *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static tcp_u32t wheel_time = 0;     /* the tick it runs next */
+static int wheel_timers = 0;        /* nr of timers on it */
+
+/* the time out of wait_for_ack() */
+static tcp_timer_t wait_timer = {NULL, NULL, 0, NULL, wait_expire};
+static int wait_expired = 0;
+
+/* the deadline of a tcp_*_deadline() call */
+static tcp_timer_t deadline_timer = {NULL, NULL, 0, NULL, deadline_expire};
+static tcp_u32t deadline_at;
+static int deadline_passed = 0;
+
+/* when we last took a packet, and when we took one again after a
+   pause, see tcp_now() */
+static tcp_u32t rcv_idle = 0;
+static tcp_u32t rcv_resumed = 0;
+
+/* cookies servers gave us, and the key for the cookies we give out */
+static tfo_entry_t tfo_cache[TFO_CACHE_SIZE];
+static int tfo_cache_next = 0;
+static tcp_u32t tfo_key[2];
+static int tfo_key_set = 0;
+
+/* the key for the seq nrs of a backlog, see backlog_iss() */
+static tcp_u32t iss_key = 0;
+static int iss_key_set = 0;
+
+/* the packets of the receiver thread, see start_receiver() */
+static rx_packet_t rx_queue[RX_QUEUE_SIZE];
+static int rx_head = 0;
+static int rx_count = 0;
+static pthread_mutex_t rx_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t rx_thread;
+/* readable when there is work, for the application and for us */
+static int event_pipe[2] = {-1, -1};
+static int wake_pipe[2] = {-1, -1};
+/* makes event_pipe readable when the first timer is due, once
+   tcp_fileno() made it */
+static timer_t event_timer;
+static int event_timer_ok = 0;
+
+/* the background thread, see tcp_engine_start() */
+static pthread_t engine_thread;
+static int engine_running = 0;
+/* held by the call in progress, or by the engine */
+static pthread_mutex_t stack_lock;
+static int engine_depth = 0;   /* how deep the calls in progress go */
+
 
 
 /* -----------TCP primitives---------- */
@@ -139,6 +644,14 @@ static int alarm_went_off = 0;
    Returns 0, but -1 on error  */
 
 int tcp_socket(void) {
+    return tcp_socket_fd(0);
+}
+
+int tcp_socket_fd_unlocked(int fd) {
+
+    if (use_tcb(fd) == -1) {
+        return -1;
+    }
 
     if (!my_ipaddr){
         ip_init();
@@ -147,113 +660,503 @@ int tcp_socket(void) {
         return -1;
     }
 
+    if (tcb->rcv_data == NULL) {
+        tcb->rcv_data = malloc(tcb->rcv_buf_size);
+        if (tcb->rcv_data == NULL) {
+            return -1;
+        }
+    }
+
+    if (tcb->snd_data == NULL) {
+        tcb->snd_data = malloc(tcb->snd_buf_size);
+        if (tcb->snd_data == NULL) {
+            return -1;
+        }
+    }
+
     declare_event(E_SOCKET_OPEN);
-    tcb.our_ipaddr = my_ipaddr;
+    tcb->our_ipaddr = my_ipaddr;
+    tcb->timed_out = 0;
+
+    return 0;
+}
+
+
+
+/*
+    Opens a connection next to the one of tcp_socket(), as tcp_socket()
+    does. The calls that end in _fd work on it like the ones without a
+    descriptor do on theirs; a connection it makes uses its own local
+    port. All connections take their packets while any call waits.
+    Returns the descriptor of the connection, or -1 on error.
+*/
+
+int tcp_open_unlocked(void) {
+
+    int fd;
+
+    fd = free_fd();
+    if (fd == -1 || alloc_tcb(fd) == -1) {
+        return -1;
+    }
+    if (tcp_socket_fd(fd) == -1) {
+        tcp_release(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+
+/*
+    Frees the connection with descriptor fd, from tcp_open() or
+    tcp_accept(), and its buffers. Close it first, they are not told.
+    A listener also frees the connections tcp_accept() didn't return.
+    Returns 0, but -1 if there is no such connection.
+*/
+
+int tcp_release_unlocked(int fd) {
+
+    if (fd == 0 || use_tcb(fd) == -1) {
+        return -1;
+    }
 
+    stop_listening();
+    timer_stop(&tcb->rtx_timer);
+    timer_stop(&tcb->ack_timer);
+    tcb->state = S_CLOSED;
+    rehash_tcb();
+    free(tcb->rcv_data);
+    free(tcb->snd_data);
+    free(tcb);
+    conns[fd] = NULL;
+    tcb = NULL;
     return 0;
 }
 
 
 
 int tcp_connect(ipaddr_t dst, int port) {
+    return tcp_connect_fd(0, dst, port);
+}
+
+int tcp_connect_fd_unlocked(int fd, ipaddr_t dst, int port) {
 
-    if (tcb.state != S_CLOSED) {
+    if (use_tcb(fd) == -1) {
+        return -1;
+    }
+
+    if (tcb->state != S_CLOSED) {
         return -1;
     }
 
     declare_event(E_CONNECT);
-    tcb.our_port = CLIENT_PORT;
-    tcb.their_ipaddr = dst;
-    tcb.their_port = port; 
+    tcb->mss = min(DEFAULT_MSS, tcb->rcv_mss);
+    cong_init(&tcb->cc, tcb->cc.ops, tcb->mss);
+    tcb->sack_ok = 0;
+    tcb->sacked_count = 0;
+    tcb->wscale_ok = 0;
+    tcb->snd_wscale = 0;
+    tcb->ts_ok = 0;
+    tcb->rcv_wscale = wscale_for(tcb->rcv_buf_size);
+    tcb->our_port = CLIENT_PORT + fd;
+    tcb->their_ipaddr = dst;
+    tcb->their_port = port; 
 
     return send_syn();
 
 }
 
 
+
+/*
+    Connects like tcp_connect(), and writes buf like tcp_write(). The
+    ack that completes the handshake goes with the first data. With
+    tcp_fastopen() on and a cookie from this server, the first segment
+    of buf already goes in the SYN.
+    Returns number of bytes written, or -1 on error.
+*/
+
+int tcp_connect_write(ipaddr_t dst, int port, const char *buf, int len) {
+    return tcp_connect_write_fd(0, dst, port, buf, len);
+}
+
+int tcp_connect_write_fd_unlocked(int fd, ipaddr_t dst, int port,
+                                  const char *buf, int len) {
+
+    tfo_entry_t *entry;
+    int result, sent;
+
+    if (use_tcb(fd) == -1) {
+        return -1;
+    }
+
+    entry = tcb->fastopen ? fastopen_entry(dst, 0) : NULL;
+    if (entry != NULL && len > 0) {
+        tcb->syn_data = buf;
+        tcb->syn_data_len = min(len, entry->mss);
+        memcpy(tcb->tfo_cookie, entry->cookie, entry->cookie_len);
+        tcb->tfo_cookie_len = entry->cookie_len;
+    }
+
+    tcb->data_follows = len > 0;
+    result = tcp_connect_fd(fd, dst, port);
+    tcb->data_follows = 0;
+    tcb->syn_data = NULL;
+    tcb->syn_data_len = 0;
+    tcb->tfo_cookie_len = 0;
+
+    if (result != 0) {
+        return -1;
+    }
+
+    /* what their SYN-ACK acked of the data in our SYN */
+    sent = tcb->our_seq_nr - tcb->iss - 1;
+    if (sent == len) {
+        if (tcb->ack_pending) {
+            send_ack();
+        }
+        return len;
+    }
+
+    result = tcp_write_fd(fd, &buf[sent], len - sent);
+    return result == -1 ? -1 : sent + result;
+}
+
+
 int tcp_listen(int port, ipaddr_t *src) {
+    return tcp_listen_fd(0, port, src);
+}
+
+/*
+    Waits for a client to connect to port, and does the handshake. A
+    SIGALRM interrupts it; the handler of the user gets the signal
+    when we return.
+    Returns 0, but -1 on error or when interrupted. The client goes in
+    src.
+*/
+
+int tcp_listen_fd_unlocked(int fd, int port, ipaddr_t *src) {
+
     void (*oldsig)(int);
+    int result;
+
+    alarm_went_off = 0;
+    /* use our own alarm function when alarm goes off */
+    oldsig = signal(SIGALRM, tcp_alarm);
+
+    result = listen_for(fd, port, src);
+
+    restore_alarm(oldsig);
+    return result;
+}
+
+/*
+    The same, but gives up at deadline instead, see tcp_now(); no
+    signal is involved.
+*/
+
+int tcp_listen_deadline_unlocked(int fd, int port, ipaddr_t *src,
+                                 tcp_u32t deadline) {
+
+    int result;
+
+    deadline_start(deadline);
+    result = listen_for(fd, port, src);
+    deadline_stop();
+
+    return result;
+}
+
+/* tcp_listen_fd() without the signal handling */
+
+int listen_for(int fd, int port, ipaddr_t *src) {
+
+    if (use_tcb(fd) == -1) {
+        return -1;
+    }
     
-    if (tcb.state != S_CLOSED) {
+    if (tcb->state != S_CLOSED) {
         return -1;
     }
 
-    tcb.our_port = port;
+    tcb->mss = min(DEFAULT_MSS, tcb->rcv_mss);
+    cong_init(&tcb->cc, tcb->cc.ops, tcb->mss);
+    tcb->sack_ok = 0;
+    tcb->sacked_count = 0;
+    tcb->wscale_ok = 0;
+    tcb->snd_wscale = 0;
+    tcb->ts_ok = 0;
+    tcb->rcv_wscale = wscale_for(tcb->rcv_buf_size);
+    tcb->tfo_cookie_len = 0;
+    tcb->our_port = port;
     /* we don't know their port yet */
-    tcb.their_port = 0;
-    
-    /* reset alarm_went_off */
-    alarm_went_off = 0;
-    /* use our own alarm fucntion when alarm goes of */
-    oldsig = signal(SIGALRM, tcp_alarm);
+    tcb->their_port = 0;
 
     declare_event(E_LISTEN);
-    while (alarm_went_off == 0 && tcb.state != S_ESTABLISHED) {
+    while (!interrupted() && tcb->state != S_ESTABLISHED &&
+           tcb->state != S_SYN_ACK_SENT) {
         do_packet();
-        if (tcb.state == S_SYN_RECEIVED) {
+        if (tcb->state == S_SYN_RECEIVED && tcb->rcvd_data_size > 0) {
+            if (fastopen_accept() == -1) {
+                return -1;
+            }
+        } else if (tcb->state == S_SYN_RECEIVED) {
             send_syn();
-            if (tcb.state != S_ESTABLISHED) {
+            if (tcb->state != S_ESTABLISHED) {
                 return -1;
             }
         }
     }
-    
-    if (alarm_went_off) {
-        /* reset alarm_went_of and call original alarm function */
-        alarm_went_off = 0;
-        oldsig(SIGALRM);
+
+    if (interrupted()) {
+        return -1;
+    }
+    *src = tcb->their_ipaddr;
+    return 0;
+}
+
+
+
+/*
+    fd      a connection from tcp_open(), without a connection yet
+    port    the port to listen on
+    backlog the most handshakes that may be under way at once, and the
+            most connections waiting for tcp_accept(); up to
+            SYN_BACKLOG_MAX
+
+    Unlike tcp_listen(), returns right away: from now on fd takes any
+    SYN for port while any call waits, and answers it. Until the ack of
+    our SYN-ACK comes, the handshake only has a small entry in the
+    backlog; then it becomes a connection, which tcp_accept() returns. A
+    Fast Open SYN with a valid cookie becomes one right away. A SYN that
+    finds the backlog full is dropped, so they send it again later.
+    Returns 0, but -1 on error.
+*/
+
+int tcp_listen_backlog_unlocked(int fd, int port, int backlog) {
+
+    if (use_tcb(fd) == -1) {
         return -1;
-    } else {
-        /* restore old signal handler */
-        signal(SIGALRM, oldsig);
     }
-    *src = tcb.their_ipaddr;
+
+    if (tcb->state != S_CLOSED || backlog < 1 || backlog > SYN_BACKLOG_MAX) {
+        return -1;
+    }
+
+    tcb->listener = malloc(sizeof(listener_t));
+    if (tcb->listener == NULL) {
+        return -1;
+    }
+    memset(tcb->listener, 0, sizeof(listener_t));
+    tcb->listener->backlog = backlog;
+
+    tcb->rcv_wscale = wscale_for(tcb->rcv_buf_size);
+    tcb->our_port = port;
+    tcb->their_ipaddr = 0;
+    tcb->their_port = 0;
+
+    declare_event(E_LISTEN);
     return 0;
 }
 
 
-int tcp_close(void){
 
-    if (tcb.state != S_ESTABLISHED
-        && tcb.state != S_CLOSE_WAIT) {
+/*
+    Waits until the listener fd, see tcp_listen_backlog(), has a new
+    connection, and takes it off the queue; the oldest comes first.
+    Meanwhile we resend the SYN-ACKs that were not acked. Like
+    tcp_listen(), a SIGALRM interrupts it. A non-blocking listener only
+    takes the packets that are there, see tcp_nonblock().
+    Returns the descriptor of the connection, which is the user's to
+    tcp_release(), or -1 on error, with errno EAGAIN if a non-blocking
+    listener has none. Its peer goes in src.
+*/
+
+int tcp_accept_unlocked(int fd, ipaddr_t *src) {
+
+    void (*oldsig)(int) = SIG_DFL;
+    listener_t *l;
+    int conn_fd, nonblock;
+
+    if (use_tcb(fd) == -1) {
+        return -1;
+    }
+
+    l = tcb->listener;
+    if (tcb->state != S_LISTEN || l == NULL) {
+        return -1;
+    }
+
+    nonblock = tcb->nonblock;
+    if (nonblock) {
+        deadline_start(tcp_now() + NONBLOCK_WAIT);
+    } else {
+        alarm_went_off = 0;
+        oldsig = signal(SIGALRM, tcp_alarm);
+    }
+
+    while (!interrupted() && l->accept_count == 0) {
+        do_packet();
+    }
+
+    if (nonblock) {
+        deadline_stop();
+    } else {
+        restore_alarm(oldsig);
+    }
+    if (l->accept_count == 0) {
+        errno = nonblock ? EAGAIN : EINTR;
+        return -1;
+    }
+
+    conn_fd = l->accepted[l->accept_head];
+    l->accept_head = (l->accept_head + 1) % SYN_BACKLOG_MAX;
+    l->accept_count--;
+
+    *src = conns[conn_fd]->their_ipaddr;
+    return conn_fd;
+}
+
+
+/*
+    Sends what is left in the send buffer, with our FIN after it, and
+    waits until they acked all of it. A non-blocking connection doesn't
+    wait; the rest goes out during later calls, and tcp_poll() reports
+    it closed once it is done.
+    Returns 0, but -1 if they didn't get all data.
+*/
+
+int tcp_close(void) {
+    return tcp_close_fd(0);
+}
+
+int tcp_close_fd_unlocked(int fd) {
+
+    if (use_tcb(fd) == -1) {
+        return -1;
+    }
+
+    if (tcb->state != S_ESTABLISHED
+        && tcb->state != S_SYN_ACK_SENT
+        && tcb->state != S_CLOSE_WAIT) {
         return -1;
     }
 
-    declare_event(E_CLOSE);
-    send_fin();
+    buffer_data(NULL, 0, 1);
+    if (tcb->nonblock) {
+        return 0;
+    }
+
+    /* the data first; a FIN they don't ack doesn't make us fail */
+    if (send_buffered(1) == -1) {
+        return -1;
+    }
+    send_buffered(0);
     return 0;
 }
 
 
 
 int tcp_read(char *buf, int maxlen) {
+    return tcp_read_fd(0, buf, maxlen);
+}
+
+/*
+    Reads what they sent, up to maxlen bytes, and waits for it if there
+    is nothing yet. A SIGALRM interrupts the wait; the handler of the
+    user gets the signal when we return. A non-blocking connection only
+    takes the packets that are there, see tcp_nonblock().
+    Returns the nr of bytes read, 0 once they closed the connection, or
+    -1 on error, with errno EAGAIN if a non-blocking read found nothing.
+*/
+
+int tcp_read_fd_unlocked(int fd, char *buf, int maxlen) {
+
+    void (*oldsig)(int);
+    int result;
+
+    if (use_tcb(fd) == -1) {
+        return -1;
+    }
+    if (tcb->nonblock) {
+        return tcp_read_deadline(fd, buf, maxlen, tcp_now() + NONBLOCK_WAIT);
+    }
+
+    alarm_went_off = 0;
+    /* use our own alarm function when alarm goes off */
+    oldsig = signal(SIGALRM, tcp_alarm);
+
+    result = read_data(fd, buf, maxlen);
+
+    restore_alarm(oldsig);
+    return result;
+}
+
+/*
+    The same, but waits until deadline instead, see tcp_now(); no
+    signal is involved.
+    Returns -1, not 0, with errno EAGAIN, if the deadline passed before
+    any byte came.
+*/
+
+int tcp_read_deadline_unlocked(int fd, char *buf, int maxlen,
+                               tcp_u32t deadline) {
+
+    int result;
+
+    deadline_start(deadline);
+    result = read_data(fd, buf, maxlen);
+    /* a 0 after their FIN is the end of their data, not the deadline */
+    if (result == 0 && deadline_passed &&
+        (tcb->state == S_ESTABLISHED || tcb->state == S_SYN_ACK_SENT ||
+         tcb->state == S_FIN_WAIT_1 || tcb->state == S_FIN_WAIT_2)) {
+        errno = EAGAIN;
+        result = -1;
+    }
+    deadline_stop();
+
+    return result;
+}
+
+/* tcp_read_fd() without the signal handling */
+
+int read_data(int fd, char *buf, int maxlen) {
 
-    int delivered_bytes;
+    int delivered_bytes, offered;
+
+    if (use_tcb(fd) == -1) {
+        return -1;
+    }
     
-    if (tcb.state != S_ESTABLISHED &&
-        tcb.state != S_FIN_WAIT_1 &&
-        tcb.state != S_FIN_WAIT_2 &&
-        tcb.state != S_CLOSING &&
-        tcb.state != S_CLOSE_WAIT &&
-        tcb.state != S_LAST_ACK &&
-        tcb.state != S_CLOSED) {
+    if (tcb->state != S_ESTABLISHED &&
+        tcb->state != S_SYN_ACK_SENT &&
+        tcb->state != S_FIN_WAIT_1 &&
+        tcb->state != S_FIN_WAIT_2 &&
+        tcb->state != S_CLOSING &&
+        tcb->state != S_CLOSE_WAIT &&
+        tcb->state != S_LAST_ACK &&
+        tcb->state != S_CLOSED) {
         
         /* if not in one of these states, tcp_read is not willing to help */
         return -1;
     }
+
+    /* they can't answer what we are still holding back */
+    push_data();
     
     /*  if the buffer is empty... */
-    if ( tcb.rcvd_data_size == 0 ) {
+    if ( tcb->rcvd_data_size == 0 ) {
     
         /* and a fin is received, return 0; everything went fine*/
-        if (tcb.state == S_CLOSING || 
-            tcb.state == S_CLOSE_WAIT || 
-            tcb.state == S_LAST_ACK) {
+        if (tcb->state == S_CLOSING || 
+            tcb->state == S_CLOSE_WAIT || 
+            tcb->state == S_LAST_ACK) {
             return 0;
         } 
         
         /*and the connection is closed, return ERROR, no read possible */
-        if (tcb.state == S_CLOSED) {
+        if (tcb->state == S_CLOSED) {
             return -1;
         }    
     }
@@ -261,9 +1164,10 @@ int tcp_read(char *buf, int maxlen) {
 
     /* if we are in one of these states we haven't received a fin yet, */
     /* so we try to receive new data */
-    if (tcb.state == S_ESTABLISHED
-        || tcb.state == S_FIN_WAIT_1
-        || tcb.state == S_FIN_WAIT_2) {
+    if (tcb->state == S_ESTABLISHED
+        || tcb->state == S_SYN_ACK_SENT
+        || tcb->state == S_FIN_WAIT_1
+        || tcb->state == S_FIN_WAIT_2) {
         
         /* returns immediately if PSH-flagged data in the buffer */
         receive_new_data(maxlen);
@@ -271,6 +1175,16 @@ int tcp_read(char *buf, int maxlen) {
     
     /* copy bytes to user buffer */
     delivered_bytes = deliver_received_bytes(buf, maxlen);
+
+    /* if this at least doubled the window they know of, let them know */
+    offered = max((int) (tcb->rcv_adv - tcb->ack_nr), 0);
+    if ((tcb->state == S_ESTABLISHED
+         || tcb->state == S_FIN_WAIT_1
+         || tcb->state == S_FIN_WAIT_2) &&
+        (int) receive_window() > offered &&
+        (int) receive_window() >= 2 * offered) {
+        send_ack();
+    }
     
     return delivered_bytes;
 
@@ -282,13 +1196,10 @@ int tcp_read(char *buf, int maxlen) {
 void receive_new_data(int maxlen) {
 
     int bytes_to_read;
-    void (*oldsig)(int);
     
-    bytes_to_read = min(maxlen, BUFFER_SIZE);
-    /* reset alarm_went_off */
-    alarm_went_off = 0;
-    /* use our own alarm fucntion when alarm goes of */
-    oldsig = signal(SIGALRM, tcp_alarm);
+    /* only the end of a write is pushed; don't wait for more than a
+       segment, or our window closes while the user waits */
+    bytes_to_read = min(maxlen, tcb->rcv_mss);
 
     /*
       While there's no data we have to push AND there's room to read more:
@@ -296,25 +1207,57 @@ void receive_new_data(int maxlen) {
     */
 
     /* call do_packet while conditions are met */
-    while ( alarm_went_off == 0 && 
-            tcb.rcvd_data_psh == 0 && 
-            tcb.rcvd_data_size < bytes_to_read &&
+    while ( !interrupted() && 
+            tcb->rcvd_data_psh == 0 && 
+            tcb->rcvd_data_size < bytes_to_read &&
             /* make sure we didn't receive a fin: */
-            tcb.state != S_CLOSED &&
-            tcb.state != S_CLOSE_WAIT &&
-            tcb.state != S_LAST_ACK) {
+            tcb->state != S_CLOSED &&
+            tcb->state != S_CLOSE_WAIT &&
+            tcb->state != S_LAST_ACK) {
             
         do_packet();
     }
-     
-    if (alarm_went_off) {
-        /* reset alarm_went_off and call original alarm function */
-        alarm_went_off = 0;
-        oldsig(SIGALRM);
-    }  else {
-        /* restore old signal handler */
-        signal(SIGALRM, oldsig);
+}
+
+
+
+/* Returns the window we are willing to advertise. This is the free space
+    in our buffer, but the right edge of the window only moves when it can
+    move by RCV_SWS_THRESHOLD bytes, so we don't invite tiny segments. */
+
+tcp_u32t receive_window(void) {
+
+    int free_space, offered;
+
+    /* handle_data() acks bytes before it copies them to the buffer */
+    free_space = tcb->rcv_buf_size - tcb->rcvd_data_size 
+                    - (tcb->ack_nr - tcb->their_seq_nr);
+
+    /* what is left of the window we advertised before */
+    offered = max((int) (tcb->rcv_adv - tcb->ack_nr), 0);
+
+    if (free_space - offered >= RCV_SWS_THRESHOLD) {
+        offered = free_space;
     }
+    return min(offered, free_space);
+}
+
+
+
+/* Returns receive_window(), scaled down for the window field of an
+    outgoing segment with these flags, and remembers its right edge. The
+    window in a SYN is never scaled. */
+
+tcp_u16t advertise_window(tcp_u8t flags) {
+
+    tcp_u32t window;
+    int shift;
+
+    shift = (flags & SYN_FLAG) ? 0 : tcb->rcv_wscale;
+    window = min(receive_window() >> shift, 0xffff);
+    tcb->rcv_adv = tcb->ack_nr + (window << shift);
+
+    return window;
 }
 
 
@@ -326,533 +1269,3909 @@ int deliver_received_bytes(char *buf, int maxlen) {
     
     int bytes_to_copy, size, first_chunk_sz;
     
-    bytes_to_copy = min(maxlen, tcb.rcvd_data_size);
+    bytes_to_copy = min(maxlen, tcb->rcvd_data_size);
     
     /* copy first chunk out of circular buffer*/
-    first_chunk_sz = BUFFER_SIZE - tcb.rcvd_data_start;
+    first_chunk_sz = tcb->rcv_buf_size - tcb->rcvd_data_start;
     size = min(bytes_to_copy, first_chunk_sz);
-    memcpy(buf, &tcb.rcv_data[tcb.rcvd_data_start], size);
+    memcpy(buf, &tcb->rcv_data[tcb->rcvd_data_start], size);
 
     /* possibly copy second chunk if delivered data wraps in buffer */
     if (bytes_to_copy > first_chunk_sz) {
-        memcpy(&buf[size], tcb.rcv_data, bytes_to_copy - first_chunk_sz);
+        memcpy(&buf[size], tcb->rcv_data, bytes_to_copy - first_chunk_sz);
     }
 
     /* adjust buffer pointers */
-    tcb.rcvd_data_size -= bytes_to_copy;
-    tcb.rcvd_data_psh = max(tcb.rcvd_data_psh - bytes_to_copy, 0);
-    tcb.rcvd_data_start = (tcb.rcvd_data_start + bytes_to_copy) % BUFFER_SIZE;
+    tcb->rcvd_data_size -= bytes_to_copy;
+    tcb->rcvd_data_psh = max(tcb->rcvd_data_psh - bytes_to_copy, 0);
+    tcb->rcvd_data_start = (tcb->rcvd_data_start + bytes_to_copy) 
+                            % tcb->rcv_buf_size;
 
     return bytes_to_copy;
 }
 
 
 
-int tcp_write(const char *buf, int len){
-    
-    int bytes_sent = 0, bytes_left, data_sz;
-    char *buf_pointer;
-    
-    bytes_left = len;
-    buf_pointer = (char *) buf;
+/*
+    Copies buf to the send buffer, sends what their window allows, and
+    returns without waiting for their acks. The rest goes out, and is
+    resent if lost, as acks and time outs are handled in later calls.
+    Only waits while the send buffer is full; a non-blocking connection
+    only takes the packets that are there, see tcp_nonblock().
+    Returns number of bytes written, which is less than len if a
+    non-blocking write filled the buffer, or -1 on error, with errno
+    EAGAIN if none fit.
+*/
 
-    if (tcb.state != S_ESTABLISHED) {
-        return -1;
-    }
+int tcp_write(const char *buf, int len) {
+    return tcp_write_fd(0, buf, len);
+}
 
-    while (bytes_left) {
-        data_sz = min(MAX_TCP_DATA, bytes_left);
+int tcp_write_fd_unlocked(int fd, const char *buf, int len) {
 
-        bytes_sent = send_data(buf_pointer, data_sz);
-        
-        if (bytes_sent == -1) {break;}
-        
-        buf_pointer += bytes_sent;
-        bytes_left -= bytes_sent;
-        
+    if (use_tcb(fd) == -1) {
+        return -1;
     }
-    
-    if (bytes_left == len) {
-        /* will also happen if len=0*/
+    if (tcb->nonblock) {
+        return tcp_write_deadline(fd, buf, len, tcp_now() + NONBLOCK_WAIT);
+    }
+
+    /* after a Fast Open SYN we may answer before the handshake is done */
+    if (tcb->state != S_ESTABLISHED && tcb->state != S_SYN_ACK_SENT) {
         return -1;
-    } else {
-        return len - bytes_left;
     }
 
+    return buffer_data(buf, len, 0);
 }
 
+/*
+    The same, but only waits for room in the send buffer until
+    deadline, see tcp_now().
+    Returns number of bytes written, which is less than len if the
+    deadline passed first, or -1 on error, with errno EAGAIN if none fit.
+*/
 
+int tcp_write_deadline_unlocked(int fd, const char *buf, int len,
+                                tcp_u32t deadline) {
+
+    int result;
+
+    if (use_tcb(fd) == -1) {
+        return -1;
+    }
+
+    if (tcb->state != S_ESTABLISHED && tcb->state != S_SYN_ACK_SENT) {
+        return -1;
+    }
+
+    deadline_start(deadline);
+    result = buffer_data(buf, len, 0);
+    if (result == -1 && deadline_passed) {
+        errno = EAGAIN;
+    }
+    deadline_stop();
+
+    return result;
+}
+
+
+
+/*
+    Writes buf like tcp_write(), and closes the connection like
+    tcp_close(), but the FIN goes with the last segment of buf.
+    Returns number of bytes written, or -1 on error.
+*/
+
+int tcp_write_close(const char *buf, int len) {
+    return tcp_write_close_fd(0, buf, len);
+}
+
+int tcp_write_close_fd_unlocked(int fd, const char *buf, int len) {
+
+    if (use_tcb(fd) == -1) {
+        return -1;
+    }
+
+    if (tcb->state != S_ESTABLISHED
+        && tcb->state != S_SYN_ACK_SENT
+        && tcb->state != S_CLOSE_WAIT) {
+        return -1;
+    }
+
+    if (len == 0) {
+        return tcp_close_fd(fd);
+    }
+    if (buffer_data(buf, len, 1) != len) {
+        return -1;
+    }
+    if (tcb->nonblock) {
+        return len;
+    }
+    if (send_buffered(1) == -1) {
+        return -1;
+    }
+    send_buffered(0);
+    return len;
+}
+
+
+
+/*
+    on      1 to hold back writes, 0 to send them again
+
+    While corked, tcp_write() only sends full segments, and keeps the
+    rest in the send buffer until more is written, or tcp_flush(),
+    tcp_cork(0), tcp_read() or tcp_close() is called.
+    Returns 0.
+*/
+
+int tcp_cork(int on) {
+    return tcp_cork_fd(0, on);
+}
+
+int tcp_cork_fd_unlocked(int fd, int on) {
+
+    if (use_tcb(fd) == -1) {
+        return -1;
+    }
+
+    tcb->corked = on;
+    if (!on) {
+        push_data();
+    }
+    return 0;
+}
+
+
+
+/*
+    Sends what tcp_write() buffered, what tcp_cork() held back included,
+    and waits until they acked all of it.
+    Returns 0, but -1 on error.
+*/
+
+int tcp_flush(void) {
+    return tcp_flush_fd(0);
+}
+
+int tcp_flush_fd_unlocked(int fd) {
+
+    if (use_tcb(fd) == -1) {
+        return -1;
+    }
+
+    if (tcb->snd_data_len == 0) {
+        return 0;
+    }
+    if (tcb->state != S_ESTABLISHED
+        && tcb->state != S_SYN_ACK_SENT
+        && tcb->state != S_CLOSE_WAIT) {
+        return -1;
+    }
+    push_data();
+    return send_buffered(0);
+}
+
+
+
+/*
+    on      1 to send small segments right away, 0 to hold back a small
+            segment while an earlier one is unacked (Nagle)
+    Returns 0.
+*/
+
+int tcp_nodelay(int on) {
+    return tcp_nodelay_fd(0, on);
+}
+
+int tcp_nodelay_fd_unlocked(int fd, int on) {
+
+    if (use_tcb(fd) == -1) {
+        return -1;
+    }
+
+    tcb->nodelay = on;
+    return 0;
+}
+
+
+
+/*
+    on      1 to make calls on the connection return instead of waiting,
+            0 to let them wait again
+
+    A non-blocking tcp_read(), tcp_write() or tcp_accept() handles the
+    packets that are there, waiting at most NONBLOCK_WAIT for them, and
+    fails with errno EAGAIN if it would have to wait for more; tcp_poll()
+    waits until it wouldn't. tcp_close() and tcp_write_close() don't wait
+    for the acks. Connecting and tcp_listen() still wait, and so do the
+    tcp_*_deadline() calls, until their deadline.
+    Returns 0.
+*/
+
+int tcp_nonblock(int on) {
+    return tcp_nonblock_fd(0, on);
+}
+
+int tcp_nonblock_fd_unlocked(int fd, int on) {
+
+    if (use_tcb(fd) == -1) {
+        return -1;
+    }
+
+    tcb->nonblock = on;
+    return 0;
+}
+
+
+
+/*
+    fds     the connections to watch, each with the TCP_POLL* events to
+            wait for in events
+    nfds    the nr of entries in fds
+    timeout the most usec to wait, 0 to only take the packets that are
+            there, or -1 to wait as long as it takes
+
+    Handles the packets and timers of all connections until one in fds
+    is ready for one of its events, and sets revents of each entry to
+    the events it is ready for. TCP_POLLCLOSED needs not be asked for.
+    Returns the nr of entries with events in revents, 0 on time out, or
+    -1 on error.
+*/
+
+int tcp_poll_unlocked(tcp_pollfd_t *fds, int nfds, long timeout) {
+
+    int ready;
+
+    if (nfds < 1) {
+        return -1;
+    }
+
+    if (timeout >= 0) {
+        deadline_start(tcp_now() + 
+                       (timeout > NONBLOCK_WAIT ? timeout : NONBLOCK_WAIT));
+    }
+
+    while ((ready = poll_ready(fds, nfds)) == 0 && !interrupted()) {
+        do_packet();
+    }
+
+    deadline_stop();
+    return ready;
+}
+
+
+
+/*
+    Sets revents of the nfds entries in fds, see tcp_poll().
+    Returns the nr of entries with events in revents, or -1 if one is
+    not a connection.
+*/
+
+int poll_ready(tcp_pollfd_t *fds, int nfds) {
+
+    int i, ready = 0;
+
+    for (i = 0; i < nfds; i++) {
+        if (use_tcb(fds[i].fd) == -1) {
+            return -1;
+        }
+        fds[i].revents = poll_events() & (fds[i].events | TCP_POLLCLOSED);
+        if (fds[i].revents != 0) {
+            ready++;
+        }
+    }
+    return ready;
+}
+
+
+
+/* Returns the TCP_POLL* events the connection we work on is ready for */
+
+short poll_events(void) {
+
+    short events = 0;
+
+    if (tcb->listener != NULL) {
+        return tcb->listener->accept_count > 0 ? TCP_POLLACCEPT : 0;
+    }
+
+    /* tcp_read() returns data, or 0 after their FIN */
+    if (tcb->rcvd_data_size > 0 ||
+        tcb->state == S_CLOSE_WAIT ||
+        tcb->state == S_CLOSING ||
+        tcb->state == S_LAST_ACK) {
+        events |= TCP_POLLIN;
+    }
+
+    if ((tcb->state == S_ESTABLISHED || tcb->state == S_SYN_ACK_SENT) &&
+        !tcb->snd_fin && tcb->snd_data_len < tcb->snd_buf_size) {
+        events |= TCP_POLLOUT;
+    }
+
+    /* all done, or they went away */
+    if (tcb->state == S_CLOSED || tcb->state == S_TIME_WAIT) {
+        events |= TCP_POLLCLOSED;
+    }
+    return events;
+}
+
+
+
+/*
+    Returns a descriptor that becomes readable when the stack has work:
+    a packet came in, or a timer is due. tcp_process_events() then does
+    it without waiting, so an event loop can run the stack next to its
+    own descriptors. The packets come from the thread of
+    start_receiver(), which this starts if no call waited yet.
+    Returns the descriptor, or -1 on error.
+*/
+
+int tcp_fileno(void) {
+
+    struct sigevent ev;
+
+    if (event_timer_ok) {
+        return event_pipe[0];
+    }
+
+    if (!my_ipaddr) {
+        ip_init();
+    }
+    if (!my_ipaddr) {
+        return -1;
+    }
+    if (start_receiver() == -1) {
+        return -1;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.sigev_notify = SIGEV_THREAD;
+    ev.sigev_notify_function = timer_due;
+    if (timer_create(CLOCK_MONOTONIC, &ev, &event_timer) == -1) {
+        return -1;
+    }
+    event_timer_ok = 1;
+    return event_pipe[0];
+}
+
+
+
+/*
+    Starts the thread that waits in ip_receive() for us, see
+    receive_packets(), with the pipes it wakes us through. The calls
+    that wait then poll for its packets, with the first timer on the
+    wheel as time out, see wait_for_packet(); no signal is involved.
+    Returns 0, but -1 on error.
+*/
+
+int start_receiver(void) {
+
+    if (event_pipe[0] != -1) {
+        return 0;
+    }
+
+    if (pipe(event_pipe) == -1) {
+        return -1;
+    }
+    if (pipe(wake_pipe) == -1) {
+        close(event_pipe[0]);
+        close(event_pipe[1]);
+        event_pipe[0] = -1;
+        return -1;
+    }
+    /* a full pipe is readable enough */
+    fcntl(event_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(event_pipe[1], F_SETFL, O_NONBLOCK);
+    fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+
+    if (pthread_create(&rx_thread, NULL, receive_packets, NULL) != 0) {
+        close(event_pipe[0]);
+        close(event_pipe[1]);
+        close(wake_pipe[0]);
+        close(wake_pipe[1]);
+        event_pipe[0] = -1;
+        wake_pipe[0] = -1;
+        return -1;
+    }
+    return 0;
+}
+
+
+
+/*
+    Handles the packets that came in and the timers that are due, of
+    all connections, without waiting; see tcp_fileno(). Afterwards the
+    connections may be ready for other calls, which tcp_poll() with a
+    timeout of 0 tells.
+    Returns the nr of packets and timers handled, or -1 if there is no
+    tcp_fileno().
+*/
+
+int tcp_process_events_unlocked(void) {
+
+    char buf[64];
+    int handled = 0;
+
+    if (!event_timer_ok) {
+        return -1;
+    }
+
+    /* what comes in from now on makes it readable again */
+    while (read(event_pipe[0], buf, sizeof(buf)) > 0) {}
+
+    if (tcb != NULL) {
+        arm_timers();
+    }
+    while (rx_pending() || timers_due()) {
+        do_packet();
+        handled++;
+    }
+    arm_event_timer();
+
+    return handled;
+}
+
+
+
+/*
+    Starts a thread of ours that runs the stack in the background: it
+    waits on tcp_fileno() and calls tcp_process_events(), so acks go
+    out, data comes in and timers fire while the application is busy
+    elsewhere. From then on each call takes the stack lock, and the
+    thread only runs while none is in progress; a call that waits still
+    handles the packets itself. The application must then leave
+    tcp_fileno() and tcp_process_events() to us, and make its calls
+    from one thread.
+    Returns 0, but -1 on error.
+*/
+
+int tcp_engine_start(void) {
+
+    pthread_mutexattr_t attr;
+
+    if (engine_running) {
+        return 0;
+    }
+    if (tcp_fileno() == -1) {
+        return -1;
+    }
+
+    /* the calls call each other */
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&stack_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    engine_running = 1;
+    if (pthread_create(&engine_thread, NULL, run_engine, NULL) != 0) {
+        engine_running = 0;
+        pthread_mutex_destroy(&stack_lock);
+        return -1;
+    }
+
+    /* the timers that run already */
+    notify(event_pipe[1]);
+    return 0;
+}
+
+
+
+/*
+    The calls of tcp.h that use the tcbs; each is name_unlocked() under
+    the stack lock, see tcp_engine_start()
+*/
+
+#define LOCKED(type, name, params, args) \
+    type name params { \
+        type result; \
+        engine_lock(); \
+        result = name##_unlocked args; \
+        engine_unlock(); \
+        return result; \
+    }
+
+LOCKED(int, tcp_socket_fd, (int fd), (fd))
+LOCKED(int, tcp_open, (void), ())
+LOCKED(int, tcp_release, (int fd), (fd))
+LOCKED(int, tcp_connect_fd, (int fd, ipaddr_t dst, int port),
+       (fd, dst, port))
+LOCKED(int, tcp_connect_write_fd,
+       (int fd, ipaddr_t dst, int port, const char *buf, int len),
+       (fd, dst, port, buf, len))
+LOCKED(int, tcp_listen_fd, (int fd, int port, ipaddr_t *src),
+       (fd, port, src))
+LOCKED(int, tcp_listen_deadline,
+       (int fd, int port, ipaddr_t *src, tcp_u32t deadline),
+       (fd, port, src, deadline))
+LOCKED(int, tcp_listen_backlog, (int fd, int port, int backlog),
+       (fd, port, backlog))
+LOCKED(int, tcp_accept, (int fd, ipaddr_t *src), (fd, src))
+LOCKED(int, tcp_close_fd, (int fd), (fd))
+LOCKED(int, tcp_read_fd, (int fd, char *buf, int maxlen), (fd, buf, maxlen))
+LOCKED(int, tcp_read_deadline,
+       (int fd, char *buf, int maxlen, tcp_u32t deadline),
+       (fd, buf, maxlen, deadline))
+LOCKED(int, tcp_write_fd, (int fd, const char *buf, int len), (fd, buf, len))
+LOCKED(int, tcp_write_deadline,
+       (int fd, const char *buf, int len, tcp_u32t deadline),
+       (fd, buf, len, deadline))
+LOCKED(int, tcp_write_close_fd, (int fd, const char *buf, int len),
+       (fd, buf, len))
+LOCKED(int, tcp_cork_fd, (int fd, int on), (fd, on))
+LOCKED(int, tcp_flush_fd, (int fd), (fd))
+LOCKED(int, tcp_nodelay_fd, (int fd, int on), (fd, on))
+LOCKED(int, tcp_nonblock_fd, (int fd, int on), (fd, on))
+LOCKED(int, tcp_poll, (tcp_pollfd_t *fds, int nfds, long timeout),
+       (fds, nfds, timeout))
+LOCKED(int, tcp_process_events, (void), ())
+LOCKED(long, tcp_rto_fd, (int fd), (fd))
+LOCKED(int, tcp_congestion_fd, (int fd, const char *name), (fd, name))
+LOCKED(int, tcp_mss_fd, (int fd), (fd))
+LOCKED(int, tcp_sack_fd, (int fd), (fd))
+LOCKED(int, tcp_set_mss_fd, (int fd, int mss), (fd, mss))
+LOCKED(int, tcp_set_rcvbuf_fd, (int fd, int size), (fd, size))
+LOCKED(int, tcp_set_sndbuf_fd, (int fd, int size), (fd, size))
+LOCKED(int, tcp_fastopen_fd, (int fd, int on), (fd, on))
+LOCKED(int, tcp_fastopen_cookie, (ipaddr_t dst, char *cookie), (dst, cookie))
+LOCKED(int, tcp_set_fastopen_cookie,
+       (ipaddr_t dst, const char *cookie, int len), (dst, cookie, len))
+
+
+
+/* Returns the current retransmission time out in microseconds */
+
+long tcp_rto(void) {
+    return tcp_rto_fd(0);
+}
+
+long tcp_rto_fd_unlocked(int fd) {
+
+    if (use_tcb(fd) == -1) {
+        return -1;
+    }
+
+    return tcb->rto;
+}
+
+
+
+/*
+    Selects the congestion control algorithm ("reno" or "cubic") for the
+    connection. Call before tcp_connect() or tcp_listen().
+    Returns 0, but -1 if there is no such algorithm.
+*/
+
+int tcp_congestion(const char *name) {
+    return tcp_congestion_fd(0, name);
+}
+
+int tcp_congestion_fd_unlocked(int fd, const char *name) {
+
+    const cong_ops_t *ops;
+
+    if (use_tcb(fd) == -1) {
+        return -1;
+    }
+
+    ops = cong_find(name);
+    if (ops == NULL) {
+        return -1;
+    }
+
+    cong_init(&tcb->cc, ops, tcb->mss);
+    return 0;
+}
+
+
+
+/* Returns the largest segment we send on this connection, in bytes */
+
+int tcp_mss(void) {
+    return tcp_mss_fd(0);
+}
+
+int tcp_mss_fd_unlocked(int fd) {
+
+    if (use_tcb(fd) == -1) {
+        return -1;
+    }
+
+    return tcb->mss;
+}
+
+
+
+/* Returns 1 if both sides agreed on SACK in the handshake, 0 if not */
+
+int tcp_sack(void) {
+    return tcp_sack_fd(0);
+}
+
+int tcp_sack_fd_unlocked(int fd) {
+
+    if (use_tcb(fd) == -1) {
+        return -1;
+    }
+
+    return tcb->sack_ok;
+}
+
+
+
+/*
+    Limits the segments we send and accept to mss data bytes, e.g. to
+    fit a smaller MTU. Takes effect from the next connection on.
+    Returns 0, but -1 if mss is out of range.
+*/
+
+int tcp_set_mss(int mss) {
+    return tcp_set_mss_fd(0, mss);
+}
+
+int tcp_set_mss_fd_unlocked(int fd, int mss) {
+
+    if (use_tcb(fd) == -1) {
+        return -1;
+    }
+
+    if (mss < MIN_MSS || mss > MAX_TCP_DATA) {
+        return -1;
+    }
+    tcb->rcv_mss = mss;
+    return 0;
+}
+
+
+
+/*
+    Sets the size of the receive buffer to size bytes; beyond 64KB the
+    window we advertise is scaled (RFC 7323). Only allowed while there is
+    no connection.
+    Returns 0, but -1 on error.
+*/
+
+int tcp_set_rcvbuf(int size) {
+    return tcp_set_rcvbuf_fd(0, size);
+}
+
+int tcp_set_rcvbuf_fd_unlocked(int fd, int size) {
+
+    char *buf;
+
+    if (use_tcb(fd) == -1) {
+        return -1;
+    }
+
+    if (tcb->state != S_START && tcb->state != S_CLOSED) {
+        return -1;
+    }
+    if (size < 2 * MAX_TCP_DATA || size > MAX_BUFFER_SIZE) {
+        return -1;
+    }
+
+    buf = malloc(size);
+    if (buf == NULL) {
+        return -1;
+    }
+    free(tcb->rcv_data);
+    tcb->rcv_data = buf;
+    tcb->rcv_buf_size = size;
+    tcb->rcvd_data_start = 0;
+    tcb->rcvd_data_size = 0;
+    return 0;
+}
+
+
+
+/*
+    Sets the size of the send buffer to size bytes. tcp_write() returns
+    as soon as its data fits in there. Only allowed while there is no
+    connection.
+    Returns 0, but -1 on error.
+*/
+
+int tcp_set_sndbuf(int size) {
+    return tcp_set_sndbuf_fd(0, size);
+}
+
+int tcp_set_sndbuf_fd_unlocked(int fd, int size) {
+
+    char *buf;
+
+    if (use_tcb(fd) == -1) {
+        return -1;
+    }
+
+    if (tcb->state != S_START && tcb->state != S_CLOSED) {
+        return -1;
+    }
+    if (size < 2 * MAX_TCP_DATA || size > MAX_BUFFER_SIZE) {
+        return -1;
+    }
+
+    buf = malloc(size);
+    if (buf == NULL) {
+        return -1;
+    }
+    free(tcb->snd_data);
+    tcb->snd_data = buf;
+    tcb->snd_buf_size = size;
+    tcb->snd_data_start = 0;
+    tcb->snd_data_len = 0;
+    return 0;
+}
+
+
+
+/*
+    on      1 to use TCP Fast Open (RFC 7413), 0 not to
+
+    A client asks servers for a cookie, and once it has one,
+    tcp_connect_write() sends the first data in the SYN. A server gives
+    out cookies, and tcp_listen() returns as soon as a SYN with a valid
+    cookie brings data, so it can be answered right away.
+    Returns 0.
+*/
+
+int tcp_fastopen(int on) {
+    return tcp_fastopen_fd(0, on);
+}
+
+int tcp_fastopen_fd_unlocked(int fd, int on) {
+
+    if (use_tcb(fd) == -1) {
+        return -1;
+    }
+
+    if (on && !tfo_key_set) {
+        /* cookies are only good as long as we run */
+        tfo_key[0] = mix32(tcp_now() ^ time(NULL) ^ getpid());
+        tfo_key[1] = mix32(tfo_key[0] + ts_now());
+        tfo_key_set = 1;
+    }
+    tcb->fastopen = on;
+    return 0;
+}
+
+
+
+/*
+    Copies the Fast Open cookie we have from dst to cookie, which must
+    have room for TFO_COOKIE_MAX bytes, e.g. to keep it for a later run.
+    Returns the length of the cookie, 0 if we have none.
+*/
+
+int tcp_fastopen_cookie_unlocked(ipaddr_t dst, char *cookie) {
+
+    tfo_entry_t *entry;
+
+    entry = fastopen_entry(dst, 0);
+    if (entry == NULL) {
+        return 0;
+    }
+    memcpy(cookie, entry->cookie, entry->cookie_len);
+    return entry->cookie_len;
+}
+
+
+
+/*
+    Gives us a Fast Open cookie for dst that we got before, see
+    tcp_fastopen_cookie().
+    Returns 0, but -1 if len is not a valid cookie length.
+*/
+
+int tcp_set_fastopen_cookie_unlocked(ipaddr_t dst, const char *cookie,
+                                    int len) {
+
+    tfo_entry_t *entry;
+
+    if (len < TFO_COOKIE_MIN || len > TFO_COOKIE_MAX) {
+        return -1;
+    }
+    entry = fastopen_entry(dst, 1);
+    memcpy(entry->cookie, cookie, len);
+    entry->cookie_len = len;
+    return 0;
+}
+
+
+/* ----------------------------------- */
+/*              STATE TIER             */
 /* ----------------------------------- */
-/*              STATE TIER             */
-/* ----------------------------------- */
 
 
-void do_packet(void) {
-    ipaddr_t their_ip;
-    tcp_u16t src_port, dst_port, win_sz;
-    tcp_u32t seq_nr, ack_nr;
-    tcp_u8t flags;
-    char data[MAX_TCP_DATA];
-    int data_sz = 0, rcvd;
- 
-    rcvd = recv_tcp_packet(&their_ip, &src_port, &dst_port, 
-                        &seq_nr, &ack_nr, &flags, &win_sz, data, &data_sz);
+void do_packet(void) {
+    ipaddr_t their_ip;
+    tcp_u16t src_port, dst_port, win_sz;
+    tcp_u32t seq_nr, ack_nr;
+    tcp_u8t flags;
+    char data[MAX_TCP_DATA], options[MAX_TCP_OPTIONS];
+    int data_sz = 0, options_sz = 0, rcvd;
+    tcp_options_t opts;
+    tcb_t *ours = tcb, *conn;
+
+    /* what the user did may have started or stopped timers */
+    if (tcb != NULL) {
+        arm_timers();
+    }
+    /* the caller may wait for one of those that are due */
+    if (run_timers() > 0) {
+        return;
+    }
+
+    /* while the user had us away, acks may have waited for us */
+    if ((int) (tcp_now() - rcv_idle) > RTO_GRANULARITY) {
+        rcv_resumed = tcp_now();
+    }
+ 
+    /* the receiver thread has ip_receive(), so we can wait for the
+       first timer too; without it we block until a packet comes */
+    if (start_receiver() == 0) {
+        wait_for_packet();
+    }
+    rcvd = recv_tcp_packet(&their_ip, &src_port, &dst_port, &seq_nr, &ack_nr,
+                &flags, &win_sz, options, &options_sz, data, &data_sz);
+    rcv_idle = tcp_now();
+
+    if (rcvd == -1) {
+        return;
+    }
+
+    /* the packet may be for another connection than the user's */
+    conn = find_tcb(dst_port, their_ip, src_port, flags);
+    if (conn == NULL) {
+        return;
+    }
+    tcb = conn;
+
+    /* a listener with a backlog keeps the handshakes to itself, until
+       one makes a connection, see tcp_listen_backlog() */
+    if (tcb->listener != NULL) {
+        parse_options(options, options_sz, &opts);
+        conn = handle_backlog(flags, seq_nr, ack_nr, win_sz, &opts,
+                              their_ip, src_port, data, data_sz);
+        if (conn == NULL) {
+            arm_timers();
+            tcb = ours;
+            return;
+        }
+        tcb = conn;
+    }
+
+    /* only accept syn if packet is legal and state is LISTEN */    
+    if (tcb->state == S_LISTEN && 
+        (flags & SYN_FLAG) && 
+        !(flags & ACK_FLAG)) {
+        
+        tcb->their_port = src_port;
+    }
+    
+    if (packet_is_valid(seq_nr, ack_nr, flags, 
+                        src_port, dst_port, data_sz)) {
+
+        parse_options(options, options_sz, &opts);
+
+        if (!paws_reject(flags, seq_nr, data_sz, &opts)) {
+
+            handle_ack(flags, seq_nr, ack_nr, win_sz, data_sz, &opts);
+            handle_data(flags, seq_nr, data, data_sz);
+            handle_syn(flags, seq_nr, win_sz, &opts, their_ip,
+                       data, data_sz);
+            handle_fin(flags, seq_nr, data_sz);
+            
+            /* we store this to detect duplicate packets later on */
+            tcb->their_previous_seq_nr = seq_nr;
+            tcb->their_previous_flags = flags;
+        }
+    }
+
+    arm_timers();
+    tcb = ours;
+}
+
+
+
+/*
+    PAWS (RFC 7323): a segment with a timestamp older than the latest we
+    took is an old duplicate, maybe from before the seq nrs wrapped. We
+    ack it, as for any other duplicate, and drop it. Otherwise its
+    timestamp is the one to echo if it is the next we wait for.
+    Returns 1 if the segment is to be dropped, 0 otherwise.
+*/
+
+int paws_reject(tcp_u8t flags, tcp_u32t seq_nr, int data_sz,
+                tcp_options_t *opts) {
+
+    if (!tcb->ts_ok || !opts->ts_ok || (flags & (SYN_FLAG | RST_FLAG))) {
+        return 0;
+    }
+
+    if (SEQ_LT(opts->tsval, tcb->ts_recent)) {
+        if (data_sz > 0 || (flags & FIN_FLAG)) {
+            send_ack();
+        }
+        return 1;
+    }
+
+    if (SEQ_LEQ(seq_nr, tcb->last_ack_sent)) {
+        tcb->ts_recent = opts->tsval;
+    }
+    return 0;
+}
+
+
+void handle_ack(tcp_u8t flags, tcp_u32t seq_nr, tcp_u32t ack_nr,
+                tcp_u16t win_sz, int data_sz, tcp_options_t *opts) {
+
+    tcp_u32t newly_acked, in_flight, window;
+    int duplicate, delivered = 0;
+    long rtt;
+
+    if (!(ACK_FLAG & flags)){
+        return;
+    }
+    tcb->acks_rcvd++;
+
+    /* the window in a SYN is never scaled */
+    window = win_sz;
+    if (!(flags & SYN_FLAG)) {
+        window <<= tcb->snd_wscale;
+    }
+
+    /* both unsigned; an old ack wraps around and exceeds in_flight */
+    newly_acked = ack_nr - tcb->our_seq_nr;
+    in_flight = tcb->expected_ack - tcb->our_seq_nr;
+
+    if (newly_acked > in_flight) {
+        return;
+    }
+    /* they are alive */
+    tcb->snd_retries = 0;
+
+    /* a duplicate ack tells us a segment arrived after a gap; with SACK
+       it says so itself, even if their window changed meanwhile */
+    duplicate = newly_acked == 0 && in_flight > 0 && data_sz == 0 &&
+                !(flags & (SYN_FLAG | FIN_FLAG)) &&
+                (window == tcb->snd_wnd || 
+                 (tcb->sack_ok && opts->sack_count > 0));
+
+    /* don't let a reordered older segment shrink their window */
+    if ((flags & SYN_FLAG) ||
+        SEQ_LT(tcb->snd_wl1, seq_nr) ||
+        (tcb->snd_wl1 == seq_nr && SEQ_LEQ(tcb->snd_wl2, ack_nr))) {
+
+        tcb->snd_wnd = window;
+        tcb->snd_wl1 = seq_nr;
+        tcb->snd_wl2 = ack_nr;
+        if (window > tcb->max_snd_wnd) {
+            tcb->max_snd_wnd = window;
+        }
+        if (window > 0) {
+            tcb->probes = 0;
+        }
+    }
+
+    if (tcb->sack_ok) {
+        handle_sack(opts);
+        delivered = rack_update(ack_nr);
+    }
+
+    if (duplicate) {
+
+        tcb->dupacks++;
+
+        /* fast retransmit, unless we already recover from this loss */
+        if (tcb->dupacks == DUPACK_THRESHOLD && !tcb->in_recovery &&
+            SEQ_LEQ(tcb->recover, ack_nr)) {
+
+            tcb->in_recovery = 1;
+            tcb->recover = tcb->expected_ack;
+            tcb->cc.ops->on_loss(&tcb->cc, in_flight);
+            /* the segments that caused the dupacks have left the network */
+            tcb->cwnd_inflation = DUPACK_THRESHOLD * tcb->mss;
+            tcb->rexmit_nxt = ack_nr;
+            retransmit_hole();
+
+        } else if (tcb->in_recovery) {
+            /* another segment left the network; use that to resend the
+               next hole they told us about, or to send new data */
+            tcb->cwnd_inflation += tcb->mss;
+            if (retransmit_hole() == 0) {
+                send_window(0);
+            }
+        }
+
+    } else if (newly_acked > 0) {
+
+        /* with timestamps every ack is a sample, even after a resend;
+           not if it echoes a window probe or what we sent before it,
+           as that waited for their reader */
+        if (tcb->ts_ok && opts->ts_ok && opts->tsecr != 0) {
+            /* less than a tick is no round trip of 0 */
+            rtt = (long) max((int) (ts_now() - opts->tsecr), 1) * TS_TICK;
+            if ((!tcb->probed || !SEQ_LEQ(opts->tsecr, tcb->probe_ts)) &&
+                !rtt_stale(rtt)) {
+                tcb->probed = 0;
+                rtt_update(rtt);
+            }
+        } else {
+            rtt_sample(ack_nr);
+        }
+        tcb->dupacks = 0;
+
+        /* cumulative ack, possibly covering only part of what's in flight */
+        tcb->our_seq_nr = ack_nr;
+        release_acked(ack_nr);
+        tcb->snd_timer_base = tcp_now();
+
+        /* after a go-back we may get acks for bytes we are about to resend */
+        if (tcb->snd_nxt - ack_nr > tcb->expected_ack - ack_nr) {
+            tcb->snd_nxt = ack_nr;
+        }
+
+        /* forget what they told us about bytes they have acked now */
+        while (tcb->sacked_count > 0 && SEQ_LEQ(tcb->sacked[0].end, ack_nr)) {
+            tcb->sacked_count--;
+            memmove(&tcb->sacked[0], &tcb->sacked[1], 
+                    tcb->sacked_count * sizeof(ooo_block_t));
+        }
+        if (tcb->sacked_count > 0 && SEQ_LT(tcb->sacked[0].start, ack_nr)) {
+            tcb->sacked[0].start = ack_nr;
+        }
+        forget_sent(ack_nr);
+
+        if (SEQ_LEQ(tcb->recover, ack_nr)) {
+            tcb->rto_recovery = 0;
+        }
+
+        if (!tcb->in_recovery) {
+            /* only grow the congestion window while it is what limits
+               us, so it can't run away when their window does */
+            if (in_flight + tcb->mss > tcb->cc.ops->cwnd(&tcb->cc)) {
+                tcb->cc.ops->on_ack(&tcb->cc, newly_acked, tcp_now(), 
+                                   tcb->srtt);
+            }
+        } else if (SEQ_LT(ack_nr, tcb->recover)) {
+            /* NewReno: a partial ack means the next segment was lost
+               too, resend it right away and deflate the window by what
+               was acked */
+            tcb->cwnd_inflation -= min(newly_acked, tcb->cwnd_inflation);
+            if (newly_acked >= tcb->mss) {
+                tcb->cwnd_inflation += tcb->mss;
+            }
+            if (tcb->sacked_count == 0) {
+                tcb->rexmit_nxt = ack_nr;
+            }
+            retransmit_hole();
+        } else {
+            tcb->in_recovery = 0;
+            tcb->cwnd_inflation = 0;
+        }
+    }
+
+    tlp_ack(ack_nr, newly_acked == 0 && data_sz == 0 && delivered == 0 &&
+                    !(flags & (SYN_FLAG | FIN_FLAG)));
+
+    /* a segment sent after others arrived; those may be lost */
+    if (delivered > 0) {
+        rack_recover();
+    }
+
+    /* what they acked, or a window update, makes room for more */
+    if (!duplicate && (tcb->snd_data_len > 0 || tcb->snd_fin)) {
+        send_window(0);
+    }
+
+    /* we sent data after a Fast Open SYN; any ack acks our SYN */
+    if (tcb->syn_unacked && SEQ_LT(tcb->iss, ack_nr)) {
+        tcb->syn_unacked = 0;
+        if (tcb->state == S_SYN_ACK_SENT) {
+            declare_event(E_ACK_RECEIVED);
+        }
+    }
+
+    if (ack_nr == tcb->expected_ack) {
+
+        if (tcb->state == S_ESTABLISHED) {return;}
+
+        if (tcb->state == S_SYN_ACK_SENT ||
+            tcb->state == S_FIN_WAIT_1 ||
+            tcb->state == S_LAST_ACK ||
+            tcb->state == S_CLOSING) {
+
+            declare_event(E_ACK_RECEIVED);
+        }
+    }
+}
+
+
+
+void handle_data(tcp_u8t flags, tcp_u32t seq_nr, char *data, int data_size) {
+
+    int offset, fresh_data_start, size, free_buffer_space, ack_now;
+
+    /* data in a SYN is for handle_syn() */
+    if (data_size == 0 || (flags & SYN_FLAG)) {
+        return;
+    }
+
+    /* number of bytes we can accept */
+    free_buffer_space = tcb->rcv_buf_size - tcb->rcvd_data_size;
+
+    /* where the data starts, relative to what we expect next */
+    offset = (int) (seq_nr - tcb->their_seq_nr);
+
+    if (offset <= 0) {
+
+        /* it is what we expect, but may start with bytes we already have */
+        fresh_data_start = -offset;
+
+        if (fresh_data_start >= data_size || free_buffer_space == 0) {
+            /* a duplicate because our ack was lost; ack again */
+            send_ack();
+            return;
+        }
+
+        /* how much are we going to store? */
+        size = min(free_buffer_space, data_size - fresh_data_start);
+        copy_to_buffer(0, &data[fresh_data_start], size);
+
+        tcb->rcvd_data_size += size;
+        tcb->their_seq_nr += size;
+
+        /* this may fill the gap before data we already have */
+        ack_now = merge_ooo_blocks();
+        if (ack_now || (PSH_FLAG & flags)) {
+            tcb->rcvd_data_psh = tcb->rcvd_data_size;
+        }
+
+        /* the end of a request, or holes left: they want to hear now */
+        ack_now = ack_now || (PSH_FLAG & flags) || tcb->ooo_count > 0;
+
+    } else {
+
+        /* a segment after a gap; keep what fits in the buffer behind the
+           gap, so it doesn't have to be sent again */
+        size = min(data_size, free_buffer_space - offset);
+
+        if (size > 0 && 
+            add_block(tcb->ooo, &tcb->ooo_count, seq_nr, seq_nr + size)) {
+            copy_to_buffer(offset, data, size);
+            tcb->ooo_last = seq_nr;
+        }
+
+        /* a duplicate ack, for fast retransmit */
+        ack_now = 1;
+    }
+
+    /* ack what we have; every second full segment, or after ACK_DELAY */
+    tcb->ack_nr = tcb->their_seq_nr;
+    if (tcb->ack_pending == 0) {
+        tcb->ack_time = tcp_now();
+    }
+    tcb->ack_pending += data_size;
+
+    if (ack_now || tcb->ack_pending >= 2 * tcb->rcv_mss) {
+        send_ack();
+    }
+    
+    /* data should always fit in buffer */
+    assert(tcb->rcvd_data_size <= tcb->rcv_buf_size);
+}
+
+
+
+/* Copies data to the receive buffer, offset bytes after the data we
+    received in order */
+
+void copy_to_buffer(int offset, char *data, int size) {
+
+    int position, first_chunk_size;
+
+    position = (tcb->rcvd_data_start + tcb->rcvd_data_size + offset) 
+                % tcb->rcv_buf_size;
+
+    /* copy data to buffer and wrap at end of buffer if needed */
+    first_chunk_size = min(size, tcb->rcv_buf_size - position);
+    memcpy(&tcb->rcv_data[position], data, first_chunk_size);
+
+    if (first_chunk_size < size) {
+        memcpy(tcb->rcv_data, &data[first_chunk_size], 
+                size - first_chunk_size);
+    }
+}
+
+
+
+/*
+    Adds the range [start, end) to the sorted list blocks of count ranges,
+    merging it with the ranges it overlaps or touches. The list can hold
+    MAX_OOO_BLOCKS ranges.
+    Returns 1, but 0 if there are too many ranges to keep this one.
+*/
+
+int add_block(ooo_block_t *blocks, int *count, tcp_u32t start, tcp_u32t end) {
+
+    int i, j;
+
+    /* find the first block that doesn't end before start */
+    for (i = 0; i < *count && SEQ_LT(blocks[i].end, start); i++);
+
+    if (i == *count || SEQ_LT(end, blocks[i].start)) {
+
+        /* no overlap, insert a new block at i */
+        if (*count == MAX_OOO_BLOCKS) {
+            return 0;
+        }
+        memmove(&blocks[i + 1], &blocks[i], 
+                (*count - i) * sizeof(ooo_block_t));
+        blocks[i].start = start;
+        blocks[i].end = end;
+        (*count)++;
+        return 1;
+    }
+
+    /* grow block i, and swallow the blocks after it that it now reaches */
+    if (SEQ_LT(start, blocks[i].start)) {
+        blocks[i].start = start;
+    }
+    for (j = i + 1; j < *count && SEQ_LEQ(blocks[j].start, end); j++);
+    if (SEQ_LT(end, blocks[j - 1].end)) {
+        end = blocks[j - 1].end;
+    }
+    blocks[i].end = end;
+
+    memmove(&blocks[i + 1], &blocks[j], (*count - j) * sizeof(ooo_block_t));
+    *count -= j - i - 1;
+    return 1;
+}
+
+
+
+/*
+    Moves out of order data that now directly follows the data received
+    in order, to the data received in order.
+    Returns the number of bytes moved.
+*/
+
+int merge_ooo_blocks(void) {
+
+    int size, merged = 0;
+
+    while (tcb->ooo_count > 0 && SEQ_LEQ(tcb->ooo[0].start, tcb->their_seq_nr)) {
+
+        if (SEQ_LT(tcb->their_seq_nr, tcb->ooo[0].end)) {
+            /* the bytes are in the buffer already */
+            size = tcb->ooo[0].end - tcb->their_seq_nr;
+            tcb->rcvd_data_size += size;
+            tcb->their_seq_nr += size;
+            merged += size;
+        }
+
+        tcb->ooo_count--;
+        memmove(&tcb->ooo[0], &tcb->ooo[1], 
+                tcb->ooo_count * sizeof(ooo_block_t));
+    }
+    return merged;
+}
+
+
+
+/* Adds the ranges from a SACK option to our scoreboard */
+
+void handle_sack(tcp_options_t *opts) {
+
+    int i;
+    tcp_u32t start, end;
+
+    for (i = 0; i < opts->sack_count; i++) {
+
+        start = opts->sack[i].start;
+        end = opts->sack[i].end;
+
+        /* only believe ranges of data that we sent and is not acked */
+        if (SEQ_LT(tcb->our_seq_nr, start) && SEQ_LT(start, end) &&
+            SEQ_LEQ(end, tcb->expected_ack)) {
+            add_block(tcb->sacked, &tcb->sacked_count, start, end);
+        }
+    }
+}
+
+
+void handle_syn(tcp_u8t flags, tcp_u32t seq_nr, tcp_u16t win_sz,
+                tcp_options_t *opts, ipaddr_t their_ip,
+                char *data, int data_sz) {
+
+
+    if (!(SYN_FLAG & flags)){
+        return;
+    }
+
+    /* they resend their SYN, so they didn't get our SYN-ACK */
+    if (tcb->syn_unacked && !(ACK_FLAG & flags)) {
+        resend_syn_ack();
+        return;
+    }
+
+
+    if (tcb->state == S_LISTEN) {
+        
+        if (!(ACK_FLAG & flags)) {
+            tcb->their_ipaddr = their_ip;
+            tcb->their_seq_nr = seq_nr + 1;
+            tcb->ack_nr = seq_nr + 1;
+            tcb->rcv_adv = tcb->ack_nr;
+            tcb->ooo_count = 0;
+            tcb->sack_ok = opts->sack_permitted;
+            tcb->ts_ok = opts->ts_ok;
+            tcb->ts_recent = opts->tsval;
+            negotiate_mss(opts);
+            negotiate_wscale(opts);
+            tcb->snd_wnd = win_sz;
+            tcb->max_snd_wnd = win_sz;
+            tcb->snd_wl1 = seq_nr;
+
+            if (fastopen_data(opts, their_ip, data_sz)) {
+                copy_to_buffer(0, data, data_sz);
+                tcb->rcvd_data_size = data_sz;
+                tcb->rcvd_data_psh = data_sz;
+                tcb->their_seq_nr += data_sz;
+                tcb->ack_nr = tcb->their_seq_nr;
+                tcb->rcv_adv = tcb->ack_nr;
+            }
+            declare_event(E_SYN_RECEIVED);
+        }
+
+    } else if (tcb->state == S_SYN_SENT) {
+
+        /* they may have acked our SYN, but not the data in it */
+        if (tcb->our_seq_nr != tcb->iss) {
+
+            declare_event(E_SYN_ACK_RECEIVED);
+            tcb->their_seq_nr = seq_nr + 1;
+            tcb->ack_nr = seq_nr + 1;
+            tcb->rcv_adv = tcb->ack_nr;
+            tcb->sack_ok = opts->sack_permitted;
+            tcb->ts_ok = opts->ts_ok;
+            tcb->ts_recent = opts->tsval;
+            negotiate_mss(opts);
+            negotiate_wscale(opts);
+
+            if (tcb->fastopen && opts->tfo_cookie_len > 0) {
+                tcp_set_fastopen_cookie(tcb->their_ipaddr, opts->tfo_cookie,
+                                        opts->tfo_cookie_len);
+                fastopen_entry(tcb->their_ipaddr, 0)->mss = tcb->mss;
+            }
+
+            if (tcb->data_follows) {
+                /* the first data segment will carry the ack */
+                tcb->ack_pending = 1;
+                tcb->ack_time = tcp_now();
+            } else {
+                send_ack();
+            }
+        }
+        
+    } else if (tcb->state == S_ESTABLISHED) {
+        
+        if ( (tcb->their_previous_seq_nr == seq_nr) &&
+             (tcb->their_previous_flags & SYN_FLAG) ) {
+            /* we got a duplicate on our hands; send ack again */
+            send_ack();
+        }
+
+    }
+}
+
+
+/*
+    Handles a segment for the listener we work on, which has a backlog,
+    see tcp_listen_backlog(). A new SYN gets an entry in the backlog and
+    our SYN-ACK, unless the backlog or the accept queue is full; the ack
+    of that SYN-ACK makes the entry a connection. A Fast Open SYN with a
+    valid cookie makes one right away, which handles the SYN itself.
+    Returns the new connection, which takes the rest of the segment, or
+    NULL if the listener is done with it.
+*/
+
+tcb_t *handle_backlog(tcp_u8t flags, tcp_u32t seq_nr, tcp_u32t ack_nr,
+                      tcp_u16t win_sz, tcp_options_t *opts,
+                      ipaddr_t their_ip, tcp_u16t their_port,
+                      char *data, int data_sz) {
+
+    tcb_t *listener = tcb, *conn;
+    listener_t *l = tcb->listener;
+    syn_entry_t *entry;
+
+    entry = find_syn_entry(their_ip, their_port);
+
+    if (!(flags & SYN_FLAG)) {
+        /* the ack of our SYN-ACK, maybe with their first data */
+        if (entry == NULL || !(flags & ACK_FLAG) ||
+            ack_nr != entry->iss + 1 || seq_nr != entry->irs + 1) {
+            return NULL;
+        }
+        return accept_syn_entry(entry);
+    }
+
+    if (flags & ACK_FLAG) {
+        return NULL;
+    }
+    if (entry != NULL) {
+        /* they resend their SYN, so they didn't get our SYN-ACK */
+        send_syn_entry(entry);
+        return NULL;
+    }
+
+    /* handshakes that gave up make room */
+    resend_syn_acks();
+    if (l->syn_count == l->backlog || l->accept_count == l->backlog) {
+        return NULL;
+    }
+
+    if (fastopen_data(opts, their_ip, data_sz)) {
+        conn = new_connection();
+        if (conn == NULL) {
+            return NULL;
+        }
+        tcb = conn;
+        tcb->rcv_wscale = wscale_for(tcb->rcv_buf_size);
+        tcb->our_port = listener->our_port;
+        tcb->expected_ack = backlog_iss(their_ip, their_port);
+        clear_tcb();
+        declare_event(E_LISTEN);
+        tcb->their_port = their_port;
+        handle_syn(flags, seq_nr, win_sz, opts, their_ip, data, data_sz);
+        tcb->their_previous_seq_nr = seq_nr;
+        tcb->their_previous_flags = flags;
+        if (tcb->state != S_SYN_RECEIVED || fastopen_accept() == -1) {
+            tcp_release(conn->fd);
+        } else {
+            queue_accepted(l, conn->fd);
+        }
+        tcb = listener;
+        return NULL;
+    }
+
+    entry = find_syn_entry(0, 0);
+    entry->their_ipaddr = their_ip;
+    entry->their_port = their_port;
+    entry->irs = seq_nr;
+    entry->iss = backlog_iss(their_ip, their_port);
+    entry->snd_wnd = win_sz;
+    entry->mss = opts->mss > 0 ? max(opts->mss, MIN_MSS) : DEFAULT_MSS;
+    entry->mss = min(entry->mss, tcb->rcv_mss);
+    entry->wscale_ok = opts->wscale_ok;
+    entry->wscale = min(opts->wscale, MAX_WSCALE);
+    entry->sack_ok = opts->sack_permitted;
+    entry->ts_ok = opts->ts_ok;
+    entry->ts_recent = opts->tsval;
+    /* fastopen_data() decided on that */
+    entry->tfo_cookie = tcb->tfo_cookie_len > 0;
+    entry->retransmits = 0;
+    l->syn_count++;
+
+    send_syn_entry(entry);
+    return NULL;
+}
+
+
+/*
+    Makes the handshake of entry, in the backlog of the listener we work
+    on, an established connection, for tcp_accept().
+    Returns the connection, or NULL if there is no room for it; then the
+    entry stays, and their next segment tries again.
+*/
+
+tcb_t *accept_syn_entry(syn_entry_t *entry) {
+
+    tcb_t *listener = tcb, *conn;
+    listener_t *l = tcb->listener;
+
+    if (l->accept_count == l->backlog) {
+        return NULL;
+    }
+    conn = new_connection();
+    if (conn == NULL) {
+        return NULL;
+    }
+
+    tcb = conn;
+    tcb->our_port = listener->our_port;
+    /* all our seq nrs start after the SYN-ACK */
+    tcb->expected_ack = entry->iss + 1;
+    clear_tcb();
+    load_syn_entry(entry);
+    tcb->iss = entry->iss;
+    tcb->last_ack_sent = tcb->ack_nr;
+    tcb->snd_wnd = entry->snd_wnd;
+    tcb->max_snd_wnd = entry->snd_wnd;
+    tcb->snd_wl1 = entry->irs;
+    cong_init(&tcb->cc, tcb->cc.ops, tcb->mss);
+    /* Karn: a resent SYN-ACK is no sample */
+    if (entry->retransmits == 0) {
+        rtt_update((long) (tcp_now() - entry->time));
+    }
+    declare_event(E_ACCEPTED);
+    tcb = listener;
+
+    queue_accepted(l, conn->fd);
+    memset(entry, 0, sizeof(syn_entry_t));
+    l->syn_count--;
+    return conn;
+}
+
+
+/*
+    Returns the entry in the backlog of the listener we work on for
+    their_ip and their_port, or with both 0, a free one. NULL if there
+    is none.
+*/
+
+syn_entry_t *find_syn_entry(ipaddr_t their_ip, tcp_u16t their_port) {
+
+    listener_t *l = tcb->listener;
+    int i;
+
+    for (i = 0; i < l->backlog; i++) {
+        if (l->syn[i].their_port == their_port &&
+            l->syn[i].their_ipaddr == their_ip) {
+            return &l->syn[i];
+        }
+    }
+    return NULL;
+}
+
+
+/*
+    Returns the seq nr of our SYN-ACK to their_ip and their_port, as in
+    RFC 6528: a clock that ticks every 4 usec, plus a keyed hash of the
+    connection. A client that comes back on the same port gets a seq nr
+    that moved on since, so old duplicates don't fit in the new window.
+*/
+
+tcp_u32t backlog_iss(ipaddr_t their_ip, tcp_u16t their_port) {
+
+    if (!iss_key_set) {
+        iss_key = mix32(tcp_now() ^ time(NULL) ^ getpid());
+        iss_key_set = 1;
+    }
+
+    return tcp_now() / 4 +
+           mix32(mix32(their_ip ^ iss_key) ^
+                 ((tcp_u32t) tcb->our_port << 16 | their_port));
+}
+
+
+/*
+    Sets up the connection we work on for the handshake of entry: their
+    address and port, our ack, and what we agreed on in it.
+*/
+
+void load_syn_entry(syn_entry_t *entry) {
+
+    tcb->their_ipaddr = entry->their_ipaddr;
+    tcb->their_port = entry->their_port;
+    tcb->their_seq_nr = entry->irs + 1;
+    tcb->ack_nr = tcb->their_seq_nr;
+    tcb->rcv_adv = tcb->ack_nr;
+    tcb->mss = entry->mss;
+    tcb->sack_ok = entry->sack_ok;
+    tcb->ts_ok = entry->ts_ok;
+    tcb->ts_recent = entry->ts_recent;
+    tcb->wscale_ok = entry->wscale_ok;
+    tcb->snd_wscale = entry->wscale_ok ? entry->wscale : 0;
+    tcb->rcv_wscale = entry->wscale_ok ? wscale_for(tcb->rcv_buf_size) : 0;
+    tcb->tfo_cookie_len = 0;
+    if (entry->tfo_cookie) {
+        fastopen_make_cookie(entry->their_ipaddr, tcb->tfo_cookie);
+        tcb->tfo_cookie_len = TFO_COOKIE_LEN;
+    }
+}
+
+
+/* Puts the connection with descriptor fd in the accept queue of l */
+
+void queue_accepted(listener_t *l, int fd) {
+
+    l->accepted[(l->accept_head + l->accept_count) % SYN_BACKLOG_MAX] = fd;
+    l->accept_count++;
+}
+
+
+/*
+    Decides on the Fast Open option in their SYN: with a valid cookie we
+    take the data_sz bytes of data in it, otherwise we send them a cookie
+    in our SYN-ACK.
+    Returns 1 if we take the data, 0 otherwise.
+*/
+
+int fastopen_data(tcp_options_t *opts, ipaddr_t their_ip, int data_sz) {
+
+    tcb->tfo_cookie_len = 0;
+    if (!tcb->fastopen || !opts->tfo_ok) {
+        return 0;
+    }
+
+    fastopen_make_cookie(their_ip, tcb->tfo_cookie);
+    if (opts->tfo_cookie_len != TFO_COOKIE_LEN ||
+        memcmp(opts->tfo_cookie, tcb->tfo_cookie, TFO_COOKIE_LEN)) {
+        tcb->tfo_cookie_len = TFO_COOKIE_LEN;
+        return 0;
+    }
+    return data_sz > 0 && data_sz <= tcb->rcv_mss;
+}
+
+
+/*
+    Writes the cookie for a client at ipaddr to cookie, TFO_COOKIE_LEN
+    bytes. It is a keyed hash of the address, so we don't have to keep
+    anything; it stops casual spoofing, but is not a cryptographic MAC.
+*/
+
+void fastopen_make_cookie(ipaddr_t ipaddr, char *cookie) {
+
+    tcp_u32t h;
+
+    h = mix32(ipaddr ^ tfo_key[0]);
+    put_u32(cookie, h);
+    put_u32(&cookie[4], mix32(h ^ tfo_key[1]));
+}
+
+
+/*
+    Returns the cookie cache entry of the server at ipaddr. If there is
+    none, returns NULL, or if create is set, a new entry, which may take
+    the place of the oldest one.
+*/
+
+tfo_entry_t *fastopen_entry(ipaddr_t ipaddr, int create) {
+
+    tfo_entry_t *entry;
+    int i;
+
+    for (i = 0; i < TFO_CACHE_SIZE; i++) {
+        if (tfo_cache[i].ipaddr == ipaddr && tfo_cache[i].cookie_len > 0) {
+            return &tfo_cache[i];
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    entry = &tfo_cache[tfo_cache_next];
+    tfo_cache_next = (tfo_cache_next + 1) % TFO_CACHE_SIZE;
+    entry->ipaddr = ipaddr;
+    entry->mss = DEFAULT_MSS;
+    entry->cookie_len = 0;
+    return entry;
+}
+
+
+/* Scrambles the 32 bits of x (the murmur3 finalizer) */
+
+tcp_u32t mix32(tcp_u32t x) {
+
+    x = ((x >> 16) ^ x) * 0x85ebca6b;
+    x = ((x >> 13) ^ x) * 0xc2b2ae35;
+    return (x >> 16) ^ x;
+}
+
+
+/*
+    Sets the size of the segments we send from the MSS in their SYN, but
+    never above our own. The congestion window counts in segments of
+    this size, so it starts over.
+*/
+
+void negotiate_mss(tcp_options_t *opts) {
+
+    tcb->mss = opts->mss > 0 ? max(opts->mss, MIN_MSS) : DEFAULT_MSS;
+    tcb->mss = min(tcb->mss, tcb->rcv_mss);
+    cong_init(&tcb->cc, tcb->cc.ops, tcb->mss);
+}
+
+
+/*
+    Window scaling is only used if both SYNs carry the option; then their
+    windows are shifted by their count, and ours by the count we sent.
+*/
+
+void negotiate_wscale(tcp_options_t *opts) {
+
+    tcb->wscale_ok = opts->wscale_ok;
+    if (tcb->wscale_ok) {
+        tcb->snd_wscale = min(opts->wscale, MAX_WSCALE);
+    } else {
+        tcb->snd_wscale = 0;
+        tcb->rcv_wscale = 0;
+    }
+}
+
+
+/* Returns the smallest window shift that can advertise size bytes */
+
+int wscale_for(int size) {
+
+    int shift = 0;
+
+    while (shift < MAX_WSCALE && (size >> shift) > 0xffff) {
+        shift++;
+    }
+    return shift;
+}
+
+
+void handle_fin(tcp_u8t flags, tcp_u32t seq_nr, int data_sz) {
+    int s;
+    if (FIN_FLAG & flags) {
+        
+        s = tcb->state;
+        
+        if (s == S_ESTABLISHED || s == S_FIN_WAIT_1 || s == S_FIN_WAIT_2) {
+
+            /* the FIN comes after the data in its segment; only take it
+               once we have all data before it */
+            if (seq_nr + data_sz != tcb->their_seq_nr) {
+                return;
+            }
+        
+            tcb->their_seq_nr = seq_nr + data_sz + 1;
+            tcb->ack_nr = tcb->their_seq_nr;
+            send_ack();
+            declare_event(E_FIN_RECEIVED);
+            
+        } else if (s == S_CLOSE_WAIT || s == S_LAST_ACK) {
+        
+            /* we already received a fin; let's see if it's a duplicate */
+            if ( (tcb->their_previous_seq_nr == seq_nr) &&
+                 (tcb->their_previous_flags & FIN_FLAG) ) {
+                 /* yes, it's a duplicate; ack it again */
+                 send_ack();
+            }
+        }
+    }   
+}
+
+
+
+/*
+  buf       Buffer with bytes to send, NULL if len is 0
+  len       Number of bytes to send
+  fin       Send a FIN after the last byte, closing the connection
+
+  Copies buf to the send buffer, and sends what their window allows.
+  Only waits for acks while the buffer is full.
+  Returns number of bytes buffered, or -1 on error.
+*/
+
+int buffer_data(const char *buf, int len, int fin) {
+
+    int size, pos, first_chunk_sz, written = 0;
+
+    if (tcb->snd_data_len == 0 && !tcb->snd_fin) {
+        /* nothing is outstanding, nothing of this data arrived yet */
+        tcb->snd_data_start = 0;
+        tcb->snd_data_seq = tcb->our_seq_nr;
+        tcb->snd_nxt = tcb->our_seq_nr;
+        tcb->expected_ack = tcb->our_seq_nr;
+        tcb->rtx_count = 0;
+        tcb->rack_time = tcp_now();
+        tcb->rack_end = tcb->our_seq_nr;
+        tcb->rack_fack = tcb->our_seq_nr;
+        tcb->reorder_armed = 0;
+    }
+
+    while (written < len) {
+
+        /* copy to the end of the circular buffer, possibly wrapping */
+        pos = (tcb->snd_data_start + tcb->snd_data_len) % tcb->snd_buf_size;
+        size = min(len - written, tcb->snd_buf_size - tcb->snd_data_len);
+        first_chunk_sz = min(size, tcb->snd_buf_size - pos);
+        memcpy(&tcb->snd_data[pos], &buf[written], first_chunk_sz);
+        memcpy(tcb->snd_data, &buf[written + first_chunk_sz], 
+               size - first_chunk_sz);
+        tcb->snd_data_len += size;
+        written += size;
+
+        if (written == len) {
+            break;
+        }
+
+        /* full; wait until they acked at least a segment of it */
+        if (send_buffered(tcb->snd_buf_size - tcb->mss) == -1) {
+            if (!interrupted()) {
+                return written > 0 ? written : -1;
+            }
+            /* what fits goes out, but not the FIN */
+            fin = 0;
+            break;
+        }
+    }
+
+    tcb->snd_fin = fin;
+    if (!tcb->corked || fin) {
+        tcb->snd_psh = tcb->snd_data_seq + tcb->snd_data_len;
+    }
+
+    /* a segment that fails to go is resent like a lost one */
+    send_window(0);
+
+    if (written == 0 && !fin) {
+        /* will also happen if len=0 */
+        return -1;
+    }
+    return written;
+}
+
+
+
+/* Lets what tcp_cork() held back in the send buffer go */
+
+void push_data(void) {
+    tcb->snd_psh = tcb->snd_data_seq + tcb->snd_data_len;
+    send_window(0);
+}
+
+
+
+/*
+    Returns the len bytes at offset in the send buffer. If they wrap
+    around its end, they are copied to scratch first.
+*/
+
+const char *buffered_bytes(int offset, int len, char *scratch) {
+
+    int start, first_chunk_sz;
+
+    start = (tcb->snd_data_start + offset) % tcb->snd_buf_size;
+    first_chunk_sz = tcb->snd_buf_size - start;
+    if (len <= first_chunk_sz) {
+        return &tcb->snd_data[start];
+    }
+
+    memcpy(scratch, &tcb->snd_data[start], first_chunk_sz);
+    memcpy(&scratch[first_chunk_sz], tcb->snd_data, len - first_chunk_sz);
+    return scratch;
+}
+
+
+
+/* Drops the bytes ack_nr acks from the send buffer */
+
+void release_acked(tcp_u32t ack_nr) {
+
+    int acked;
+
+    if (!SEQ_LT(tcb->snd_data_seq, ack_nr)) {
+        return;
+    }
+
+    /* not our FIN */
+    acked = min((int) (ack_nr - tcb->snd_data_seq), tcb->snd_data_len);
+    tcb->snd_data_start = (tcb->snd_data_start + acked) % tcb->snd_buf_size;
+    tcb->snd_data_len -= acked;
+    tcb->snd_data_seq += acked;
+}
+
+
+
+/*
+    Sends what the send buffer holds, and handles acks and time outs,
+    until no more than left seq nrs of it are unacked, our FIN included.
+
+    Keeps as many segments in flight as their window allows. Meanwhile
+    the send timers of the connection run on the timer wheel, see
+    arm_timers(): on a time out we go back to the first unacked byte and
+    resend from there. While their window is closed, we probe it instead.
+    With SACK, a segment is resent early once one sent after it arrived
+    (RACK), and a loss at the tail shows after a loss probe, before the
+    time out.
+    Returns 0, but -1 if they went away, on error, or when interrupted,
+    see interrupted().
+*/
+
+int send_buffered(int left) {
+
+    while ((int) (tcb->snd_data_seq + tcb->snd_data_len + tcb->snd_fin 
+                  - tcb->our_seq_nr) > left) {
+
+        if (tcb->timed_out || interrupted() || send_window(0) == -1) {
+            return -1;
+        }
+        wait_for_ack(0);
+    }
+    return tcb->timed_out ? -1 : 0;
+}
+
+
+/*
+    Probes their closed window with the first unacked byte, which they
+    take and ack once they have room (RFC 9293).
+    Returns 0, but -1 on error.
+*/
+
+int send_probe(void) {
+
+    char scratch[1];
+
+    if (tcb->snd_data_len == 0) {
+        return 0;
+    }
+
+    /* no rtt samples from what waits for their reader */
+    tcb->rtt_timing = 0;
+    tcb->probed = 1;
+
+    if (send_segment(tcb->our_seq_nr, ACK_FLAG, 
+                     buffered_bytes(0, 1, scratch), 1) == -1) {
+        return -1;
+    }
+    tcb->probe_ts = ts_now();
+
+    /* what follows goes again once their window opens */
+    tcb->snd_nxt = tcb->our_seq_nr + 1;
+    if (SEQ_LT(tcb->expected_ack, tcb->snd_nxt)) {
+        tcb->expected_ack = tcb->snd_nxt;
+    }
+    return 0;
+}
+
+
+/*
+    Picks the timer that goes off next for what is in the send buffer:
+    the reorder timer if it runs; the persist timer while their window
+    is too small for what we have, which backs off like the
+    retransmission time out; else a loss probe if that goes off before
+    the RTO, else the RTO. T_NONE if there is nothing to time.
+    Stores how long from now it goes off in timeout.
+*/
+
+send_timer_t send_timer(long *timeout) {
+
+    long elapsed, pto, persist;
+    int unsent, i;
+
+    elapsed = (int) (tcp_now() - tcb->snd_timer_base);
+    *timeout = tcb->rto - elapsed;
+
+    if (tcb->reorder_armed) {
+        *timeout = min(*timeout, (int) (tcb->reorder_time - tcp_now()));
+        return T_REORDER;
+    }
+
+    unsent = (int) (tcb->snd_data_seq + tcb->snd_data_len - tcb->snd_nxt);
+    if (tcb->snd_data_len > 0 &&
+        (tcb->snd_wnd == 0 || (tcb->expected_ack == tcb->our_seq_nr && 
+                              (int) tcb->snd_wnd < min(tcb->mss, unsent)))) {
+        persist = tcb->rto;
+        for (i = 0; i < tcb->probes && persist < RTO_MAX; i++) {
+            persist *= 2;
+        }
+        *timeout = min(persist, RTO_MAX) - elapsed;
+        return T_PERSIST;
+    }
+
+    if (tcb->expected_ack == tcb->our_seq_nr) {
+        *timeout = 0;
+        return T_NONE;
+    }
+
+    pto = probe_timeout();
+    if (pto > 0 && pto < tcb->rto) {
+        *timeout = pto - elapsed;
+        return T_PROBE;
+    }
+    return T_RTO;
+}
+
+
+/*
+    Handles a send timer that went off: resends what RACK thinks is
+    lost, sends a loss probe, or probes their window. On a retransmission
+    time out we go back to the first unacked byte and resend from there.
+    After MAX_RETRANSMISSION time outs in a row without any ack, we give
+    up on the connection.
+    Returns 0, but -1 if we gave up, or on error.
+*/
+
+int send_timeout(send_timer_t timer) {
+
+    tcb->snd_timer_base = tcp_now();
+
+    if (timer == T_NONE) {
+        return 0;
+    }
+    if (timer == T_REORDER) {
+        rack_recover();
+        return 0;
+    }
+    if (timer == T_PROBE) {
+        return send_tlp();
+    }
+
+    if (++tcb->snd_retries == MAX_RETRANSMISSION) {
+        tcb->timed_out = 1;
+        declare_event(E_PARTNER_DEAD);
+        return -1;
+    }
+
+    if (timer == T_PERSIST) {
+        tcb->probes++;
+        if (tcb->snd_wnd > 0) {
+            /* too small for silly window avoidance, send what fits */
+            return send_window(1);
+        }
+        return send_probe();
+    }
+
+    rto_backoff();
+    tcb->cc.ops->on_rto(&tcb->cc, tcb->expected_ack - tcb->our_seq_nr);
+    tcb->cwnd_inflation = 0;
+    /* go back to the first unacked byte */
+    tcb->snd_nxt = tcb->our_seq_nr;
+    /* dupacks for what we sent before don't start a recovery */
+    tcb->in_recovery = 0;
+    tcb->dupacks = 0;
+    tcb->recover = tcb->expected_ack;
+    /* no loss probes until what we had sent is acked (RFC 8985) */
+    tcb->rto_recovery = 1;
+    /* all of it goes again anyway */
+    tcb->reorder_armed = 0;
+    tcb->tlp_pending = 0;
+    if (tcb->syn_unacked && resend_syn_ack() == -1) {
+        return -1;
+    }
+    return send_window(1);
+}
+
+
+/*
+    Returns how long we wait for an ack before we send a tail loss probe
+    (RFC 8985), or 0 if we don't send one now.
+*/
+
+long probe_timeout(void) {
+
+    long pto;
+
+    if (!tcb->sack_ok || tcb->in_recovery || tcb->rto_recovery ||
+        tcb->tlp_pending || tcb->syn_unacked || tcb->snd_wnd == 0 || 
+        tcb->expected_ack == tcb->our_seq_nr) {
+        return 0;
+    }
+
+    /* without a round trip time, there is only the RTO */
+    if (!tcb->rtt_valid && tcb->min_rtt == RTO_MAX) {
+        return 0;
+    }
+
+    pto = 2 * tcb->srtt;
+    if (tcb->expected_ack - tcb->our_seq_nr <= tcb->mss) {
+        /* the ack of a lone segment may be delayed */
+        pto += ACK_DELAY;
+    }
+    return max(pto, TLP_MIN);
+}
+
+
+/*
+    Sends a tail loss probe: a new segment if their window takes one,
+    else the last segment in flight again. Either way its ack tells us
+    about a loss at the tail, and RACK resends what is lost.
+    Returns 0, but -1 on error.
+*/
+
+int send_tlp(void) {
+
+    tcp_u32t sent = tcb->expected_ack;
+    int i;
+
+    /* our congestion window doesn't hold back the probe */
+    if (tcb->snd_nxt == tcb->expected_ack) {
+        tcb->cwnd_inflation += tcb->mss;
+        i = send_window(1);
+        tcb->cwnd_inflation -= tcb->mss;
+        if (i == -1) {
+            return -1;
+        }
+    }
+
+    tcb->tlp_retrans = tcb->expected_ack == sent;
+    if (tcb->tlp_retrans) {
+        for (i = tcb->rtx_count - 1; i > 0 && rtx_seg(i)->sacked; i--) {}
+        if (tcb->rtx_count > 0 && retransmit_segment(rtx_seg(i)) == -1) {
+            return -1;
+        }
+    }
+
+    tcb->tlp_pending = 1;
+    tcb->tlp_high_seq = tcb->expected_ack;
+    return 0;
+}
+
+
+/*
+    Ends a loss probe episode once acks beyond the probe come (RFC 8985).
+    If the probe resent a segment, and no duplicate ack showed that the
+    first copy arrived as well, the probe repaired a loss, and we slow
+    down as for one.
+*/
+
+void tlp_ack(tcp_u32t ack_nr, int dupack) {
+
+    if (!tcb->tlp_pending || SEQ_LT(ack_nr, tcb->tlp_high_seq)) {
+        return;
+    }
+
+    if (!tcb->tlp_retrans) {
+        tcb->tlp_pending = 0;
+    } else if (SEQ_LT(tcb->tlp_high_seq, ack_nr)) {
+        tcb->tlp_pending = 0;
+        if (!tcb->in_recovery) {
+            tcb->cc.ops->on_loss(&tcb->cc, tcb->cc.ops->cwnd(&tcb->cc));
+        }
+    } else if (dupack) {
+        tcb->tlp_pending = 0;
+    }
+}
+
+
+/*
+    Transmits segments from the send buffer, starting at tcb->snd_nxt,
+    until their window is full or all data is in flight. New segments
+    go in the retransmission queue; below tcb->expected_ack we resend the
+    ones in there.
+
+    Sender side silly window avoidance: a segment that is cut short by
+    their window is only sent if it fills at least half of the largest
+    window they ever advertised, or if override_sws is set (after a
+    time out).
+
+    Returns 0, but -1 on error.
+*/
+
+int send_window(int override_sws) {
+
+    int bytes_sent, data_sz, offset, usable_window, i, fin;
+    char flags, scratch[MAX_TCP_DATA];
+    rtx_seg_t *seg;
+
+    while (1) {
+
+        offset = tcb->snd_nxt - tcb->snd_data_seq;
+        data_sz = min(tcb->mss, tcb->snd_data_len - offset);
+
+        if (SEQ_LT(tcb->snd_nxt, tcb->expected_ack)) {
+            /* when going back, resend the segments as they went before,
+               but not what they told us they have */
+            for (i = rtx_find(tcb->snd_nxt); 
+                 i < tcb->rtx_count && rtx_seg(i)->sacked; i++) {
+                tcb->snd_nxt = rtx_seg(i)->seq + rtx_seg(i)->len;
+            }
+            offset = tcb->snd_nxt - tcb->snd_data_seq;
+            data_sz = min(tcb->mss, tcb->snd_data_len - offset);
+            if (i < tcb->rtx_count) {
+                seg = rtx_seg(i);
+                data_sz = min(data_sz, seg->seq + seg->len - tcb->snd_nxt);
+            }
+        } else if (tcb->rtx_count == RTX_QUEUE_SIZE) {
+            /* no room to remember another segment */
+            return 0;
+        }
+
+        /* their window, or our congestion window, may shrink below
+           what is already in flight */
+        usable_window = min(tcb->snd_wnd, 
+                tcb->cc.ops->cwnd(&tcb->cc) + tcb->cwnd_inflation) 
+                - (int) (tcb->snd_nxt - tcb->our_seq_nr);
+
+        if (usable_window < data_sz &&
+            usable_window < (int) (tcb->max_snd_wnd / 2) &&
+            !override_sws) {
+            return 0;
+        }
+        /* not even a FIN fits */
+        if (usable_window <= 0 && !override_sws) {
+            return 0;
+        }
+        data_sz = min(data_sz, usable_window);
+
+        /* a FIN goes with the last byte, or alone once all data is out */
+        fin = carries_fin(offset, max(data_sz, 0));
+
+        if (data_sz <= 0 && !fin) {
+            return 0;
+        }
+        data_sz = max(data_sz, 0);
+
+        /* Nagle, as Minshall: a small segment at the end of the data
+           waits while an earlier small one is unacked; its ack lets
+           more data join this one */
+        if (data_sz < tcb->mss && offset + data_sz == tcb->snd_data_len &&
+            !fin && !tcb->nodelay && !override_sws &&
+            SEQ_LT(tcb->our_seq_nr, tcb->snd_sml)) {
+            return 0;
+        }
+
+        /* tcp_cork() holds back a small segment at the end until the
+           data is pushed */
+        if (data_sz < tcb->mss && offset + data_sz == tcb->snd_data_len &&
+            !fin && !override_sws &&
+            tcb->snd_psh != tcb->snd_data_seq + tcb->snd_data_len) {
+            return 0;
+        }
+        override_sws = 0;
+
+        /* Karn: only time segments that are sent for the first time */
+        if (tcb->snd_nxt == tcb->expected_ack) {
+            rtt_start(tcb->snd_nxt);
+        }
+
+        /* the send timers run from when data goes out after none was */
+        if (tcb->expected_ack == tcb->our_seq_nr) {
+            tcb->snd_timer_base = tcp_now();
+        }
+
+        /* push only the end of what we were asked to send */
+        flags = ACK_FLAG;
+        if (offset + data_sz == tcb->snd_data_len) {
+            flags |= PSH_FLAG;
+        }
+        if (fin) {
+            flags |= FIN_FLAG;
+            if (tcb->state == S_ESTABLISHED || tcb->state == S_CLOSE_WAIT ||
+                tcb->state == S_SYN_ACK_SENT) {
+                declare_event(E_CLOSE);
+            }
+        }
+
+        bytes_sent = send_segment(tcb->snd_nxt, flags, 
+                    buffered_bytes(offset, data_sz, scratch), data_sz);
+
+        if (bytes_sent == -1) {
+            return -1;
+        }
+        note_sent(tcb->snd_nxt, tcb->snd_nxt + bytes_sent + fin);
+
+        tcb->snd_nxt += bytes_sent + fin;
+        if (data_sz < tcb->mss) {
+            tcb->snd_sml = tcb->snd_nxt;
+        }
+
+        /* a retransmission doesn't move the highest byte sent */
+        if (tcb->snd_nxt - tcb->our_seq_nr > tcb->expected_ack - tcb->our_seq_nr) {
+            tcb->expected_ack = tcb->snd_nxt;
+        }
+    }
+}
+
+
+/*
+    Sends a segment to the other side, with our current ack nr, window
+    and the options that go with flags.
+    Returns the nr of data bytes sent, or -1 on error.
+*/
+
+int send_segment(tcp_u32t seq_nr, tcp_u8t flags, const char *data,
+                 int data_sz) {
+
+    char options[MAX_TCP_OPTIONS];
+    int options_sz;
+
+    options_sz = build_options(flags, options);
+
+    /* this carries any ack we held back */
+    tcb->ack_pending = 0;
+    tcb->last_ack_sent = tcb->ack_nr;
+
+    return send_tcp_packet(tcb->their_ipaddr, tcb->our_port, tcb->their_port,
+            seq_nr, tcb->ack_nr, flags, advertise_window(flags), 
+            options, options_sz, data, data_sz);
+}
+
+
+
+/*
+    Resends a segment from the retransmission queue without waiting for
+    a time out.
+    Returns the nr of seq nrs sent (data and FIN), or -1 on error.
+*/
+
+int retransmit_segment(rtx_seg_t *seg) {
+
+    int data_sz, offset, fin, bytes_sent;
+    char flags = ACK_FLAG, scratch[MAX_TCP_DATA];
+
+    offset = seg->seq - tcb->snd_data_seq;
+    data_sz = min(seg->len, tcb->snd_data_len - offset);
+    fin = carries_fin(offset, max(data_sz, 0));
+
+    if (data_sz <= 0 && !fin) {
+        return 0;
+    }
+    data_sz = max(data_sz, 0);
+
+    /* Karn: the segment being timed may be resent now */
+    if (tcb->rtt_timing && SEQ_LEQ(seg->seq, tcb->rtt_seq) && 
+        SEQ_LT(tcb->rtt_seq, seg->seq + seg->len)) {
+        tcb->rtt_timing = 0;
+    }
+
+    if (offset + data_sz == tcb->snd_data_len) {
+        flags |= PSH_FLAG;
+    }
+    if (fin) {
+        flags |= FIN_FLAG;
+    }
+
+    bytes_sent = send_segment(seg->seq, flags, 
+                              buffered_bytes(offset, data_sz, scratch), data_sz);
+    if (bytes_sent == -1) {
+        return -1;
+    }
+    note_sent(seg->seq, seg->seq + bytes_sent + fin);
+    return bytes_sent + fin;
+}
+
+
+
+/*
+    Resends the next segment that we think is lost, during fast recovery.
+    With SACK that is the first hole below the highest range they told
+    us they have that was not resent yet; without it, the first unacked
+    segment, once for every time tcb->rexmit_nxt is moved back.
+    Returns the nr of bytes sent, 0 if there was nothing to resend, or
+    -1 on error.
+*/
+
+int retransmit_hole(void) {
+
+    tcp_u32t seq_nr = tcb->rexmit_nxt;
+    rtx_seg_t *seg;
+    int i, bytes_sent;
+
+    if (SEQ_LT(seq_nr, tcb->our_seq_nr)) {
+        seq_nr = tcb->our_seq_nr;
+    }
+
+    for (i = rtx_find(seq_nr); i < tcb->rtx_count && rtx_seg(i)->sacked; i++) {}
+    if (i == tcb->rtx_count) {
+        return 0;
+    }
+    seg = rtx_seg(i);
+
+    if (tcb->sacked_count == 0) {
+        if (seg->seq != tcb->our_seq_nr) {
+            return 0;
+        }
+    } else if (!SEQ_LT(seg->seq, tcb->sacked[tcb->sacked_count - 1].start)) {
+        return 0;
+    }
+
+    bytes_sent = retransmit_segment(seg);
+    if (bytes_sent > 0) {
+        tcb->rexmit_nxt = seg->seq + bytes_sent;
+    }
+    return bytes_sent;
+}
+
+
+
+/* Returns the i-th segment in the retransmission queue */
+
+rtx_seg_t *rtx_seg(int i) {
+    return &tcb->rtx_queue[(tcb->rtx_head + i) % RTX_QUEUE_SIZE];
+}
+
+
+
+/*
+    Returns the index in the retransmission queue of the first segment
+    that ends after seq_nr, or tcb->rtx_count if there is none.
+*/
+
+int rtx_find(tcp_u32t seq_nr) {
+
+    int low = 0, high = tcb->rtx_count, mid;
+    rtx_seg_t *seg;
+
+    while (low < high) {
+        mid = (low + high) / 2;
+        seg = rtx_seg(mid);
+        if (SEQ_LEQ(seg->seq + seg->len, seq_nr)) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+
+
+/*
+    Puts the segment [start, end) at the end of the retransmission queue.
+    The segments of it that are in there already get the new send time,
+    and count as retransmitted.
+*/
+
+void note_sent(tcp_u32t start, tcp_u32t end) {
+
+    tcp_u32t now = tcp_now();
+    rtx_seg_t *seg;
+    int i;
+
+    for (i = rtx_find(start); i < tcb->rtx_count; i++) {
+        seg = rtx_seg(i);
+        if (!SEQ_LT(seg->seq, end)) {
+            break;
+        }
+        seg->time = now;
+        if (seg->retransmits < 255) {
+            seg->retransmits++;
+        }
+        seg->lost = 0;
+    }
+
+    /* what goes for the first time; send_window() made room for it */
+    if (tcb->rtx_count > 0) {
+        seg = rtx_seg(tcb->rtx_count - 1);
+        if (SEQ_LT(start, seg->seq + seg->len)) {
+            start = seg->seq + seg->len;
+        }
+    }
+    if (SEQ_LT(start, end) && tcb->rtx_count < RTX_QUEUE_SIZE) {
+        seg = rtx_seg(tcb->rtx_count++);
+        seg->seq = start;
+        seg->len = end - start;
+        seg->time = now;
+        seg->retransmits = 0;
+        seg->sacked = 0;
+        seg->lost = 0;
+    }
+}
+
+
+/*
+    Takes the segments that ack_nr acks off the retransmission queue.
+    Of one it acks in part, as a window probe, only the rest stays.
+*/
+
+void forget_sent(tcp_u32t ack_nr) {
+
+    rtx_seg_t *seg;
+
+    while (tcb->rtx_count > 0) {
+        seg = rtx_seg(0);
+        if (SEQ_LEQ(seg->seq + seg->len, ack_nr)) {
+            tcb->rtx_head = (tcb->rtx_head + 1) % RTX_QUEUE_SIZE;
+            tcb->rtx_count--;
+            continue;
+        }
+        if (SEQ_LT(seg->seq, ack_nr)) {
+            seg->len -= ack_nr - seg->seq;
+            seg->seq = ack_nr;
+        }
+        return;
+    }
+}
+
+
+/*
+    Marks the segments that ack_nr or our SACK scoreboard covers as
+    delivered, and remembers the one of them we sent last, with its
+    round trip time (RFC 8985). One that arrives after a segment with a
+    higher seq nr shows they reorder.
+    Returns the nr of segments newly delivered.
+*/
+
+int rack_update(tcp_u32t ack_nr) {
+
+    tcp_u32t now = tcp_now();
+    rtx_seg_t *seg;
+    tcp_u32t end;
+    long rtt;
+    int i, j, count = 0;
+
+    for (i = 0; i < tcb->rtx_count; i++) {
+
+        seg = rtx_seg(i);
+        end = seg->seq + seg->len;
+        if (seg->sacked) {
+            continue;
+        }
+        if (SEQ_LT(ack_nr, end)) {
+            for (j = 0; j < tcb->sacked_count; j++) {
+                if (SEQ_LEQ(tcb->sacked[j].start, seg->seq) &&
+                    SEQ_LEQ(end, tcb->sacked[j].end)) {
+                    break;
+                }
+            }
+            if (j == tcb->sacked_count) {
+                continue;
+            }
+        }
+        seg->sacked = 1;
+        count++;
+
+        if (SEQ_LT(end, tcb->rack_fack)) {
+            if (seg->retransmits == 0) {
+                tcb->reordering_seen = 1;
+            }
+        } else {
+            tcb->rack_fack = end;
+        }
+
+        /* Karn: this quick, the ack was for the first copy */
+        rtt = (long) (now - seg->time);
+        if (seg->retransmits > 0 && rtt < tcb->min_rtt) {
+            continue;
+        }
+        if (rtt < tcb->min_rtt) {
+            tcb->min_rtt = rtt;
+        }
+        if (sent_after(seg->time, end, tcb->rack_time, tcb->rack_end)) {
+            tcb->rack_time = seg->time;
+            tcb->rack_end = end;
+            tcb->rack_rtt = rtt;
+        }
+    }
+    return count;
+}
+
+
+/*
+    Marks a segment lost if one we sent after it arrived, and it had a
+    round trip time and the reorder window to arrive as well (RFC 8985).
+    For segments that still may, the reorder timer goes off when they
+    have had that long.
+    Returns the nr of segments newly marked lost.
+*/
+
+int rack_detect_loss(void) {
+
+    tcp_u32t now = tcp_now();
+    long reo_wnd = reorder_window(), remaining, timeout = 0;
+    rtx_seg_t *seg;
+    int i, count = 0;
+
+    for (i = 0; i < tcb->rtx_count; i++) {
+
+        seg = rtx_seg(i);
+        if (seg->sacked || seg->lost ||
+            !sent_after(tcb->rack_time, tcb->rack_end, seg->time, 
+                        seg->seq + seg->len)) {
+            continue;
+        }
+
+        remaining = (int) (seg->time - now) + tcb->rack_rtt + reo_wnd;
+        if (remaining <= 0) {
+            seg->lost = 1;
+            count++;
+        } else if (remaining > timeout) {
+            timeout = remaining;
+        }
+    }
+
+    tcb->reorder_armed = timeout > 0;
+    tcb->reorder_time = now + timeout;
+    return count;
+}
+
+
+/*
+    Resends the segments RACK thinks are lost, and starts fast recovery
+    if we were not in it, unless we already slowed down for this data.
+*/
+
+void rack_recover(void) {
+
+    int i;
+
+    if (rack_detect_loss() == 0) {
+        return;
+    }
+
+    if (!tcb->in_recovery && SEQ_LEQ(tcb->recover, tcb->our_seq_nr)) {
+        tcb->in_recovery = 1;
+        tcb->recover = tcb->expected_ack;
+        tcb->cc.ops->on_loss(&tcb->cc, tcb->expected_ack - tcb->our_seq_nr);
+        tcb->cwnd_inflation = tcb->dupacks * tcb->mss;
+        tcb->rexmit_nxt = tcb->our_seq_nr;
+    }
+
+    for (i = 0; i < tcb->rtx_count; i++) {
+        if (rtx_seg(i)->lost && retransmit_segment(rtx_seg(i)) == -1) {
+            return;
+        }
+    }
+}
+
+
+/*
+    Returns how long a segment may be late before it counts as lost: a
+    quarter of the smallest round trip time, but none once they told us
+    of three segments after a gap, or during recovery, unless we saw
+    them reorder.
+*/
+
+long reorder_window(void) {
+
+    tcp_u32t sacked = 0;
+    long reo_wnd;
+    int i;
+
+    if (!tcb->reordering_seen) {
+        if (tcb->in_recovery) {
+            return 0;
+        }
+        for (i = 0; i < tcb->sacked_count; i++) {
+            sacked += tcb->sacked[i].end - tcb->sacked[i].start;
+        }
+        if (sacked >= DUPACK_THRESHOLD * tcb->mss) {
+            return 0;
+        }
+    }
+
+    reo_wnd = tcb->min_rtt / 4;
+    if (tcb->rtt_valid && tcb->srtt < reo_wnd) {
+        reo_wnd = tcb->srtt;
+    }
+    return reo_wnd;
+}
+
+
+/*
+    Returns 1 if the segment ending at end1 was sent after the one ending
+    at end2, by their send times, or by seq nr if sent at once.
+*/
+
+int sent_after(tcp_u32t time1, tcp_u32t end1, tcp_u32t time2, tcp_u32t end2) {
+    return (int) (time1 - time2) > 0 || (time1 == time2 && SEQ_LT(end2, end1));
+}
+
+
+
+/*
+    Returns 1 if the segment of data_sz bytes at offset in the send
+    buffer is the one to carry our FIN, 0 otherwise.
+*/
+
+int carries_fin(int offset, int data_sz) {
+    return tcb->snd_fin && offset + data_sz == tcb->snd_data_len;
+}
+
+
+
+/*
+    Sends a syn packet, with tcb->syn_data if we connect, and waits for
+    ack.
+    Returns 0, but -1 on error.
+*/
+
+int send_syn(void) {
+    
+    char flags = PSH_FLAG | SYN_FLAG;
+    int retransmission_allowed = MAX_RETRANSMISSION;
+    int result, data_sz = 0;
+
+    if (tcb->state != S_CONNECTING) {
+        flags |= ACK_FLAG;
+    } else {
+        data_sz = tcb->syn_data_len;
+    }
+    tcb->iss = tcb->our_seq_nr;
+
+    while (retransmission_allowed--) {
+    
+        /* send syn packet */
+        result = send_segment(tcb->our_seq_nr, flags, tcb->syn_data, data_sz);
+        
+        /* check result */
+        if(result == -1){
+            return -1;
+        } else {
+        
+            if (retransmission_allowed == MAX_RETRANSMISSION - 1) {
+                rtt_start(tcb->our_seq_nr);
+            }
+            tcb->expected_ack = tcb->our_seq_nr + 1 + data_sz;
+            if (flags & ACK_FLAG) {
+                declare_event(E_SYN_ACK_SENT);
+            } else {
+                declare_event(E_SYN_SENT);
+            }
+        }
+        
+        /* wait for ack */          
+        if (wait_for_ack(tcb->rto) && tcb->state == S_ESTABLISHED){
+            return 0;
+        } else if (interrupted()) {
+            return -1;
+        } else {
+            rto_backoff();
+            declare_event(E_ACK_TIME_OUT);
+        }
+    }
+    declare_event(E_PARTNER_DEAD);
+    return -1;
+}
+
+
+
+/*
+    Sends our SYN-ACK again, for a connection that went on without
+    waiting for the ack (Fast Open).
+    Returns 0, but -1 on error.
+*/
+
+int resend_syn_ack(void) {
+
+    if (send_segment(tcb->iss, PSH_FLAG | SYN_FLAG | ACK_FLAG, NULL, 0) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+
+
+/*
+    Answers a Fast Open SYN that brought data: the user gets the data
+    now, and the handshake completes meanwhile.
+    Returns 0, but -1 on error.
+*/
+
+int fastopen_accept(void) {
+
+    tcb->iss = tcb->our_seq_nr;
+    if (resend_syn_ack() == -1) {
+        return -1;
+    }
+    declare_event(E_SYN_ACK_SENT);
+    tcb->our_seq_nr++;
+    tcb->snd_nxt = tcb->our_seq_nr;
+    tcb->expected_ack = tcb->our_seq_nr;
+    tcb->snd_sml = tcb->our_seq_nr;
+    tcb->syn_unacked = 1;
+    return 0;
+}
+
+
+
+/*
+    Sends our SYN-ACK for entry in the backlog of the listener we work
+    on, which has no peer of its own.
+    Returns 0, but -1 on error.
+*/
+
+int send_syn_entry(syn_entry_t *entry) {
+
+    int result;
+
+    load_syn_entry(entry);
+    entry->time = tcp_now();
+    result = send_segment(entry->iss, PSH_FLAG | SYN_FLAG | ACK_FLAG, 
+                          NULL, 0);
+    tcb->their_ipaddr = 0;
+    tcb->their_port = 0;
+
+    return result == -1 ? -1 : 0;
+}
+
+
+
+/*
+    Resends the SYN-ACKs in the backlog of the listener we work on that
+    were not acked in time, backing off as send_syn() does; a handshake
+    is given up after MAX_RETRANSMISSION of them.
+*/
+
+void resend_syn_acks(void) {
+
+    listener_t *l = tcb->listener;
+    syn_entry_t *entry;
+    int i;
+
+    for (i = 0; i < l->backlog; i++) {
+
+        entry = &l->syn[i];
+        if (entry->their_port == 0 || 
+            syn_entry_timeout(entry) >= TIMER_TICK) {
+            continue;
+        }
+
+        if (entry->retransmits == MAX_RETRANSMISSION) {
+            memset(entry, 0, sizeof(syn_entry_t));
+            l->syn_count--;
+            continue;
+        }
+        entry->retransmits++;
+        send_syn_entry(entry);
+    }
+}
+
+
+/*
+    Returns the usec until the next SYN-ACK in the backlog of the
+    listener we work on is due, see resend_syn_acks(); RTO_MAX if there
+    is none.
+*/
+
+long syn_ack_timeout(void) {
+
+    listener_t *l = tcb->listener;
+    long timeout, next = RTO_MAX;
+    int i;
+
+    for (i = 0; i < l->backlog; i++) {
+        if (l->syn[i].their_port != 0) {
+            timeout = syn_entry_timeout(&l->syn[i]);
+            next = min(next, timeout);
+        }
+    }
+    return next;
+}
+
+
+/* Returns the usec until the SYN-ACK of entry is due again */
+
+long syn_entry_timeout(syn_entry_t *entry) {
+
+    return min(RTO_INITIAL << entry->retransmits, RTO_MAX) - 
+           (long) (tcp_now() - entry->time);
+}
+
+
+
+/*
+    Sends an ack packet.
+    Returns 0, but -1 on error.
+*/
+
+int send_ack(void) {
+
+    char flags = PSH_FLAG | ACK_FLAG;
+
+    flags |= PSH_FLAG;
+    flags |= ACK_FLAG;
+
+    /* after the data we sent, or they take it for an old segment and
+       ignore the window in it */
+    return send_segment(tcb->expected_ack, flags, NULL, 0);
+}
+
+
+
+/*
+    Handles incoming packets until new data is acked, their window
+    changes or the reorder timer starts or stops, or until timeout usec
+    have passed; with a timeout of 0, until we give up on them. The
+    wait also ends when interrupted, see interrupted().
+    Returns 1 if any such progress was made, 0 on time out.
+*/
+
+int wait_for_ack(long timeout){
+
+    tcp_u32t old_seq_nr = tcb->our_seq_nr;
+    tcp_u32t old_wnd = tcb->snd_wnd;
+    int old_armed = tcb->reorder_armed;
+
+    /* they may be waiting for it too */
+    if (tcb->ack_pending) {
+        send_ack();
+    }
+
+    wait_expired = 0;
+    if (timeout > 0) {
+        timer_start(&wait_timer, timeout);
+    }
+    
+    while (wait_expired == 0 && 
+           tcb->timed_out == 0 &&
+           !interrupted() &&
+           tcb->our_seq_nr == old_seq_nr && 
+           tcb->snd_wnd == old_wnd &&
+           tcb->reorder_armed == old_armed) {
+        do_packet();
+    }
+
+    timer_stop(&wait_timer);
+    
+    return tcb->our_seq_nr != old_seq_nr || tcb->snd_wnd != old_wnd ||
+           tcb->reorder_armed != old_armed;
+}
+
+/*
+    Starts timing the segment starting at seq_nr, unless we are already
+    timing one.
+*/
+
+void rtt_start(tcp_u32t seq_nr) {
+
+    if (!tcb->rtt_timing) {
+        tcb->rtt_timing = 1;
+        tcb->rtt_seq = seq_nr;
+        tcb->rtt_time = tcp_now();
+    }
+}
+
+
+/*
+    Takes a round trip time sample if ack_nr covers the segment being
+    timed, and updates the retransmission time out as in RFC 6298.
+*/
+
+void rtt_sample(tcp_u32t ack_nr) {
+
+    if (!tcb->rtt_timing || SEQ_LEQ(ack_nr, tcb->rtt_seq)) {
+        return;
+    }
+    tcb->rtt_timing = 0;
+    if (!rtt_stale(tcp_now() - tcb->rtt_time)) {
+        rtt_update(tcp_now() - tcb->rtt_time);
+    }
+}
+
+
+/*
+    Returns 1 if a round trip of rtt usec that ends now began well before
+    we took packets again after a pause: its ack may have waited for us,
+    and the time the user kept us away is no round trip time.
+*/
+
+int rtt_stale(long rtt) {
+    return rtt - (long) (tcp_now() - rcv_resumed) > RTO_GRANULARITY;
+}
+
+
+/* Feeds a round trip time of rtt usec to the RTO estimator (RFC 6298) */
+
+void rtt_update(long rtt) {
+
+    long delta;
+
+    if (!tcb->rtt_valid) {
+        /* first measurement */
+        tcb->srtt = rtt;
+        tcb->rttvar = rtt / 2;
+        tcb->rtt_valid = 1;
+    } else {
+        delta = tcb->srtt - rtt;
+        if (delta < 0) {
+            delta = -delta;
+        }
+        tcb->rttvar = (3 * tcb->rttvar + delta) / 4;
+        tcb->srtt = (7 * tcb->srtt + rtt) / 8;
+    }
+
+    tcb->rto = tcb->srtt + max(RTO_GRANULARITY, 4 * tcb->rttvar);
+    if (tcb->rto < RTO_MIN) {
+        tcb->rto = RTO_MIN;
+    }
+    if (tcb->rto > RTO_MAX) {
+        tcb->rto = RTO_MAX;
+    }
+}
+
+
+/*
+    Doubles the retransmission time out after a time out. The segment
+    being timed will be retransmitted, so by Karn's rule we stop timing.
+*/
+
+void rto_backoff(void) {
+
+    tcb->rtt_timing = 0;
+    tcb->rto = tcb->rto * 2;
+    if (tcb->rto > RTO_MAX) {
+        tcb->rto = RTO_MAX;
+    }
+}
+
+
+/*
+    Returns the time in microseconds on the monotonic clock, in the 32
+    bits of a tcp_u32t, so it wraps around every 71 minutes; compare
+    two times by their difference, as with SEQ_LT()
+*/
+
+tcp_u32t tcp_now(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (tcp_u32t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/* Returns the timestamp clock, in TS_TICK units */
+
+tcp_u32t ts_now(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (tcp_u32t) ts.tv_sec * (1000000 / TS_TICK) + 
+           ts.tv_nsec / (1000 * TS_TICK);
+}
+
+
+/* Returns the clock of the timer wheel, in TIMER_TICK units */
+
+tcp_u32t wheel_ticks(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (tcp_u32t) ts.tv_sec * (1000000 / TIMER_TICK) + 
+           ts.tv_nsec / (1000 * TIMER_TICK);
+}
+
+
+/*
+    Puts the timers of the connection we work on on the wheel, as its
+    state asks for now: the send timers while anything waits for an ack
+    or for their window, see send_timer(), or the SYN-ACKs of a
+    listener; and an ack we hold back.
+*/
+
+void arm_timers(void) {
+
+    long timeout;
+
+    if (tcb->listener != NULL) {
+        if (tcb->listener->syn_count > 0) {
+            timer_start(&tcb->rtx_timer, syn_ack_timeout());
+        } else {
+            timer_stop(&tcb->rtx_timer);
+        }
+    } else if ((tcb->state >= S_ESTABLISHED || tcb->syn_unacked) &&
+               send_timer(&timeout) != T_NONE) {
+        /* send_syn() times the handshake itself */
+        timer_start(&tcb->rtx_timer, timeout);
+    } else {
+        timer_stop(&tcb->rtx_timer);
+    }
+
+    if (tcb->ack_pending) {
+        timer_start(&tcb->ack_timer, 
+                    ACK_DELAY - (long) (tcp_now() - tcb->ack_time));
+    } else {
+        timer_stop(&tcb->ack_timer);
+    }
+}
+
+
+/* The send timers of the connection we work on went off */
+
+void rtx_expire(void) {
+
+    send_timer_t timer;
+    long timeout;
+
+    if (tcb->listener != NULL) {
+        resend_syn_acks();
+    } else {
+        timer = send_timer(&timeout);
+        if (timer != T_NONE && timeout < TIMER_TICK) {
+            /* if it gives up, the user's next call fails */
+            send_timeout(timer);
+        }
+    }
+    arm_timers();
+}
+
+
+/* The ack we held back went ACK_DELAY ago */
+
+void ack_expire(void) {
+
+    if (tcb->ack_pending) {
+        send_ack();
+    }
+    arm_timers();
+}
+
+
+/* The time out of wait_for_ack() went off */
+
+void wait_expire(void) {
+
+    wait_expired = 1;
+}
+
+
+/*
+    Starts the deadline of a tcp_*_deadline() call, a time of
+    tcp_now(). One that already passed interrupts the call right away.
+*/
+
+void deadline_start(tcp_u32t deadline) {
+
+    long usec = (int) (deadline - tcp_now());
+
+    deadline_at = deadline;
+    deadline_passed = usec <= 0;
+    if (!deadline_passed) {
+        timer_start(&deadline_timer, usec);
+    }
+}
+
+
+void deadline_stop(void) {
+
+    timer_stop(&deadline_timer);
+    deadline_passed = 0;
+}
+
+
+/* The deadline of the call went off, but the wheel may be a tick early */
+
+void deadline_expire(void) {
+
+    long usec = (int) (deadline_at - tcp_now());
+
+    if (usec > 0) {
+        timer_start(&deadline_timer, usec);
+    } else {
+        deadline_passed = 1;
+    }
+}
 
 
-    if (rcvd != -1) {
+/*
+    Returns 1 if the call we are in should stop waiting: a SIGALRM went
+    off, or its deadline passed; otherwise 0
+*/
 
-        /* only accept syn if packet is legal and state is LISTEN */    
-        if (tcb.state == S_LISTEN && 
-            (flags & SYN_FLAG) && 
-            !(flags & ACK_FLAG)) {
-            
-            tcb.their_port = src_port;
-        }
-        
-        if (!packet_is_valid(seq_nr, ack_nr, flags, 
-                            src_port, dst_port, data_sz)) {
+int interrupted(void) {
 
-            return;
-        }
+    return alarm_went_off || deadline_passed;
+}
 
-        /* only handle packet if it belongs to current socket */
-        if (dst_port == tcb.our_port && src_port == tcb.their_port){
-        
-            handle_ack(flags, ack_nr);
-            handle_data(flags, seq_nr, data, data_sz);
-            handle_syn(flags, seq_nr, their_ip);
-            handle_fin(flags, seq_nr);
-            
-            /* we store this to detect duplicate packets later on */
-            tcb.their_previous_seq_nr = seq_nr;
-            tcb.their_previous_flags = flags;
-        }
-    }
 
+/*
+    Puts timer t on the wheel, to go off usec microseconds from now, or
+    moves it there if it runs already.
+*/
+
+void timer_start(tcp_timer_t *t, long usec) {
+
+    tcp_u32t now = wheel_ticks();
+
+    timer_stop(t);
+    if (wheel_timers == 0) {
+        /* no need to run through the ticks that nothing waited for */
+        wheel_time = now;
+    }
+    if (usec < 0) {
+        usec = 0;
+    }
+    t->expires = now + (usec + TIMER_TICK - 1) / TIMER_TICK;
+    wheel_insert(t);
+    wheel_timers++;
 }
 
 
-void handle_ack(tcp_u8t flags, tcp_u32t ack_nr) {
+/* Takes timer t off the wheel, if it runs */
 
-    if (!(ACK_FLAG & flags)){
+void timer_stop(tcp_timer_t *t) {
+
+    if (t->pprev == NULL) {
         return;
     }
+    *t->pprev = t->next;
+    if (t->next != NULL) {
+        t->next->pprev = t->pprev;
+    }
+    t->pprev = NULL;
+    wheel_timers--;
+}
+
+
+/*
+    Runs the timers that are due, of all connections, with tcb set to the
+    connection of each. A slot of level 0 holds the timers of one tick; a
+    slot of a higher level holds those of the next WHEEL_SLOTS slots of
+    the level below it, and is spread out over them when they come up
+    (Varghese & Lauck, as in the Linux kernel). So starting and stopping
+    a timer takes constant time, whatever the nr of connections.
+    Returns the nr of timers that went off.
+*/
 
-    if (ack_nr == tcb.expected_ack) {
+int run_timers(void) {
 
-        tcb.our_seq_nr = ack_nr;
-        tcb.unacked_data_len = 0;
+    tcb_t *ours = tcb;
+    tcp_u32t now = wheel_ticks();
+    tcp_timer_t *due, *t;
+    int index, fired = 0;
 
-        if (tcb.state == S_ESTABLISHED) {return;}
+    while (wheel_timers > 0 && SEQ_LEQ(wheel_time, now)) {
 
-        if (tcb.state == S_SYN_ACK_SENT ||
-            tcb.state == S_FIN_WAIT_1 ||
-            tcb.state == S_LAST_ACK ||
-            tcb.state == S_CLOSING) {
+        index = wheel_time & (WHEEL_SLOTS - 1);
+        if (index == 0 && wheel_cascade(1) == 0 && wheel_cascade(2) == 0) {
+            wheel_cascade(3);
+        }
 
-            declare_event(E_ACK_RECEIVED);
+        /* take the slot off the wheel first: what goes off may start
+           timers again, or stop the others in it */
+        due = wheel[0][index];
+        wheel[0][index] = NULL;
+        if (due != NULL) {
+            due->pprev = &due;
+        }
+        wheel_time++;
+
+        while ((t = due) != NULL) {
+            timer_stop(t);
+            tcb = t->conn != NULL ? t->conn : ours;
+            t->expire();
+            fired++;
         }
     }
-}
 
+    tcb = ours;
+    return fired;
+}
 
 
-void handle_data(tcp_u8t flags, tcp_u32t seq_nr, char *data, int data_size) {
+/* Puts timer t in the slot of the wheel for when it expires */
 
-    tcp_u32t fresh_data_start, fresh_data_size;
-    int size, first_chunk_size, free_buffer_space, second_chunk_size, 
-        end_of_buffer, free_at_end_of_buffer, start_of_second_chunk;
+void wheel_insert(tcp_timer_t *t) {
 
-    /* number of bytes we can accept */
-    free_buffer_space = BUFFER_SIZE - tcb.rcvd_data_size;
-    
-    if (data_size > 0 && free_buffer_space > 0) {
+    long delta = (int) (t->expires - wheel_time);
+    int level = 0;
+    tcp_timer_t **slot;
 
-        /* okay, we are able to store more data */
+    if (delta < 0) {
+        /* overdue, it goes off in the next run */
+        delta = 0;
+        t->expires = wheel_time;
+    }
+    if (delta >= 1L << (WHEEL_BITS * WHEEL_LEVELS)) {
+        delta = (1L << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+        t->expires = wheel_time + delta;
+    }
+    while (delta >= 1L << (WHEEL_BITS * (level + 1))) {
+        level++;
+    }
 
-        /* calculate start of data that's new to us */
-        /* do_packet guarantees that seq_nr is never ahead 
-           of tcb.their_seq_nr, i.e. that */
-        fresh_data_start = tcb.their_seq_nr - seq_nr;
-        fresh_data_size = data_size - fresh_data_start;
+    slot = &wheel[level][(t->expires >> (WHEEL_BITS * level)) & 
+                         (WHEEL_SLOTS - 1)];
+    t->next = *slot;
+    if (t->next != NULL) {
+        t->next->pprev = &t->next;
+    }
+    *slot = t;
+    t->pprev = slot;
+}
 
-        if (fresh_data_size > 0  && fresh_data_start <= MAX_TCP_DATA) {
 
-            /* it is what we expect;
-               - at least 1 byte we don't have yet
-               - and directly following the bytes we do have 
-                 (fresh_data_start is unsigned and would wrap 
-                  around if negative, and become greater than MAX_TCP_DATA)*/
+/*
+    Spreads the timers in the slot of level that comes up now over the
+    level below it.
+    Returns the index of that slot.
+*/
 
-            /* how much are we going to store? */
-            size = min(free_buffer_space, fresh_data_size);
-            
-            
-            /* before we proceed, send an ack */
-            /* increase the number of bytes we acked */
-            tcb.ack_nr += size;
-            if ( send_ack() == -1 ) {
-                /* on error decrease ack_nr and discard data in packet */
-                tcb.ack_nr -= size;
-                return;
-            }
+int wheel_cascade(int level) {
 
+    int index = (wheel_time >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+    tcp_timer_t *t, *next;
 
-            /* check whether data in buffer has already been wrapped */
-            end_of_buffer = tcb.rcvd_data_start + tcb.rcvd_data_size;
-            if ( end_of_buffer >= BUFFER_SIZE ) {
+    t = wheel[level][index];
+    wheel[level][index] = NULL;
+    for (; t != NULL; t = next) {
+        next = t->next;
+        wheel_insert(t);
+    }
+    return index;
+}
 
-                /* buffer is wrapped already, copy to buffer in one chunck */
-                end_of_buffer -= BUFFER_SIZE;
-                memcpy(&tcb.rcv_data[end_of_buffer], 
-                                &data[fresh_data_start], size);
 
-            } else {
+/*
+    Returns the tick at which run_timers() first has work: the first
+    timer in level 0 that is due, or the first slot of a higher level to
+    be spread out over the level below it.
+*/
 
-                /* copy data to buffer and wrap at end of buffer if needed */
-                free_at_end_of_buffer = BUFFER_SIZE - end_of_buffer;
-                first_chunk_size = min(size, free_at_end_of_buffer);
+tcp_u32t wheel_next(void) {
 
-                memcpy(&tcb.rcv_data[end_of_buffer], 
-                            &data[fresh_data_start], first_chunk_size);
+    tcp_u32t next = wheel_time + (1L << (WHEEL_BITS * WHEEL_LEVELS));
+    tcp_u32t tick;
+    int level, shift, index, i;
 
-                if (first_chunk_size < size) {
+    for (level = 0; level < WHEEL_LEVELS; level++) {
 
-                    start_of_second_chunk = fresh_data_start + first_chunk_size;
-                    second_chunk_size = size - first_chunk_size;
-                    
-                    /* copy second chunck */
-                    memcpy(tcb.rcv_data, 
-                            &data[start_of_second_chunk], second_chunk_size);
-                }
+        shift = WHEEL_BITS * level;
+        index = (wheel_time >> shift) & (WHEEL_SLOTS - 1);
+        for (i = 0; i < WHEEL_SLOTS; i++) {
+            if (wheel[level][(index + i) & (WHEEL_SLOTS - 1)] != NULL) {
+                break;
+            }
+        }
+        if (i == WHEEL_SLOTS) {
+            continue;
+        }
 
+        if (level == 0) {
+            tick = wheel_time + i;
+        } else {
+            if (i == 0 && (wheel_time & ((1L << shift) - 1)) != 0) {
+                /* its turn came already, it comes again after a round */
+                i = WHEEL_SLOTS;
             }
+            tick = ((wheel_time >> shift) + i) << shift;
+        }
+        if (SEQ_LT(tick, next)) {
+            next = tick;
+        }
+    }
+    return next;
+}
 
-            tcb.rcvd_data_size += size;
-            tcb.their_seq_nr += size;
 
-            if (PSH_FLAG & flags) {
-                tcb.rcvd_data_psh = tcb.rcvd_data_size;
-            }
+/* Check validity of ports, flags, seq nr and ack nr.
+   returns 0 on error, 1 on succes */ 
 
+int packet_is_valid(tcp_u32t seq_nr, tcp_u32t ack_nr, tcp_u8t flags,
+                    tcp_u16t src_port, tcp_u16t dst_port, int data_sz) {
 
-        } else {
+    tcp_u32t diff;
+    
+    /* only accept packet if it belongs to current socket */
+    if (dst_port != tcb->our_port || src_port != tcb->their_port) {
+        return 0;
+    }
+    
+    if (tcb->state == S_LISTEN) {
+    
+        if ( !(flags & SYN_FLAG) || (flags & ACK_FLAG) ) {
+            /* in this state accept syn, but no ack */
+            return 0;
+        }
+    }
+    
+    if (tcb->state == S_SYN_SENT) {
+        /* in this state only accept syn+ack packets */
+        if ( !(flags & ACK_FLAG) || !(flags & SYN_FLAG)) {
+            return 0;
+        }
+        /* is this a reasonable ack number? */
+        diff = tcb->expected_ack - ack_nr;
+        if ( diff > MAX_TCP_DATA ) {
+            return 0;
+        }
+    }
+    
+    /* check seq and ack only if this is not a syn packet */
+    if ( !(flags & SYN_FLAG) ) {
+        /*    todo: check sequence number */
         
-            /* no fresh data, but we need to ack in case the last ack was lost*/
-            if (tcb.their_previous_seq_nr == seq_nr) {
-            /* we got a duplicate on our hands; send ack again*/
-                send_ack();
-            }
+        if ( !(flags & ACK_FLAG) ) {
+            return 0;
         }
+        
+        /* is this a reasonable ack number? anything in flight may be
+           acked, and we allow one segment of old acks */
+        diff = tcb->expected_ack - ack_nr;
+        if ( diff > tcb->expected_ack - tcb->our_seq_nr + tcb->mss ) {
+            return 0;
+        }    
+    } 
+    
+    
+    /* no more than we told them we take; handle_syn() decides on data
+       in a SYN (Fast Open) */
+    if (data_sz > tcb->rcv_mss && !(flags & SYN_FLAG)) {
+        return 0;
     }
     
-    /* data should always fit in buffer */
-    assert(tcb.rcvd_data_size <= BUFFER_SIZE);
+    return 1;
 }
 
 
-void handle_syn(tcp_u8t flags, tcp_u32t seq_nr, ipaddr_t their_ip) {
+void clear_tcb(void) {
 
+    stop_listening();
 
-    if (!(SYN_FLAG & flags)){
+    /* fast forward dirty seq_nr if the last packet wasn't acked. */
+    tcb->our_seq_nr = tcb->expected_ack;
+    /* clear some variables */
+    tcb->their_seq_nr = 0;
+    tcb->their_ipaddr = 0;
+    tcb->their_port = 0;
+    tcb->rcvd_data_start = 0;
+    tcb->rcvd_data_size = 0;
+    tcb->ooo_count = 0;
+    tcb->sacked_count = 0;
+    tcb->ack_pending = 0;
+    tcb->snd_nxt = tcb->our_seq_nr;
+    tcb->expected_ack = tcb->our_seq_nr;
+    tcb->snd_sml = tcb->our_seq_nr;
+    tcb->snd_data_start = 0;
+    tcb->snd_data_seq = tcb->our_seq_nr;
+    tcb->snd_data_len = 0;
+    tcb->snd_fin = 0;
+    tcb->snd_retries = 0;
+    tcb->probes = 0;
+    tcb->syn_unacked = 0;
+    tcb->tfo_cookie_len = 0;
+    tcb->snd_wnd = 0;
+    tcb->max_snd_wnd = 0;
+    tcb->rcv_adv = 0;
+    tcb->srtt = 0;
+    tcb->rtt_valid = 0;
+    tcb->rttvar = 0;
+    tcb->rto = RTO_INITIAL;
+    tcb->rtt_timing = 0;
+    tcb->probed = 0;
+    tcb->rtx_count = 0;
+    tcb->min_rtt = RTO_MAX;
+    tcb->reordering_seen = 0;
+    tcb->reorder_armed = 0;
+    tcb->tlp_pending = 0;
+    tcb->dupacks = 0;
+    tcb->in_recovery = 0;
+    tcb->recover = tcb->our_seq_nr;
+    tcb->rto_recovery = 0;
+    tcb->cwnd_inflation = 0;
+}
+
+
+
+/*
+    Makes the connection with descriptor fd the one we work on. The one
+    for descriptor 0 is made on first use.
+    Returns 0, but -1 if there is no such connection.
+*/
+
+int use_tcb(int fd) {
+
+    if (fd < 0 || fd >= MAX_CONNECTIONS) {
+        return -1;
+    }
+    if (conns[fd] == NULL && (fd != 0 || alloc_tcb(0) == -1)) {
+        return -1;
+    }
+    if (tcb != NULL && tcb != conns[fd]) {
+        /* what the user did on it may have started or stopped timers */
+        arm_timers();
+    }
+    tcb = conns[fd];
+    return 0;
+}
+
+
+
+/*
+    Makes a connection for descriptor fd, with the defaults of a new
+    one; its buffers come with tcp_socket().
+    Returns 0, but -1 on error.
+*/
+
+int alloc_tcb(int fd) {
+
+    tcb_t *conn;
+
+    conn = malloc(sizeof(tcb_t));
+    if (conn == NULL) {
+        return -1;
+    }
+    *conn = tcb_defaults;
+    conn->fd = fd;
+    conn->rtx_timer.conn = conn;
+    conn->ack_timer.conn = conn;
+    conns[fd] = conn;
+    return 0;
+}
+
+
+
+/* Returns a descriptor that is not in use, or -1 if all are */
+
+int free_fd(void) {
+
+    int fd;
+
+    for (fd = 1; fd < MAX_CONNECTIONS && conns[fd] != NULL; fd++) {}
+    return fd == MAX_CONNECTIONS ? -1 : fd;
+}
+
+
+
+/*
+    Makes a connection for a handshake of the listener we work on, with
+    the settings of the listener; the listener stays the one we work on.
+    Returns the connection, in CLOSED, or NULL on error.
+*/
+
+tcb_t *new_connection(void) {
+
+    tcb_t *listener = tcb, *conn;
+    int fd, result;
+
+    fd = free_fd();
+    if (fd == -1 || alloc_tcb(fd) == -1) {
+        return NULL;
+    }
+
+    conn = conns[fd];
+    conn->rcv_mss = listener->rcv_mss;
+    conn->rcv_buf_size = listener->rcv_buf_size;
+    conn->snd_buf_size = listener->snd_buf_size;
+    conn->nodelay = listener->nodelay;
+    conn->corked = listener->corked;
+    conn->fastopen = listener->fastopen;
+    conn->cc.ops = listener->cc.ops;
+
+    result = tcp_socket_fd(fd);
+    if (result == -1) {
+        tcp_release(fd);
+    }
+    tcb = listener;
+    return result == -1 ? NULL : conn;
+}
+
+
+
+/*
+    Stops the backlog of the connection we work on, if it has one: the
+    handshakes in it are dropped, and the connections tcp_accept()
+    didn't return are freed.
+*/
+
+void stop_listening(void) {
+
+    tcb_t *listener = tcb;
+    listener_t *l = tcb->listener;
+
+    if (l == NULL) {
         return;
     }
 
+    while (l->accept_count > 0) {
+        tcp_release(l->accepted[l->accept_head]);
+        l->accept_head = (l->accept_head + 1) % SYN_BACKLOG_MAX;
+        l->accept_count--;
+    }
+    tcb = listener;
 
-    if (tcb.state == S_LISTEN) {
-        
-        if (!(ACK_FLAG & flags)) {
-            tcb.their_ipaddr = their_ip;
-            tcb.their_seq_nr = seq_nr + 1;
-            tcb.ack_nr = seq_nr + 1;
-            declare_event(E_SYN_RECEIVED);
-        }
+    free(l);
+    tcb->listener = NULL;
+}
 
-    } else if (tcb.state == S_SYN_SENT) {
 
-        if (all_acks_received()) {
 
-            declare_event(E_SYN_ACK_RECEIVED);
-            tcb.their_seq_nr = seq_nr + 1;
-            tcb.ack_nr = seq_nr + 1;
-            send_ack();
+/* Returns the bucket in conn_hash for a 4-tuple */
+
+int conn_bucket(tcp_u16t our_port, ipaddr_t their_ip, tcp_u16t their_port) {
+    return mix32(their_ip ^ ((tcp_u32t) our_port << 16 | their_port)) 
+           % CONN_HASH_SIZE;
+}
+
+
+
+/*
+    Files the connection we work on in conn_hash under its 4-tuple; a
+    listening one has no address and port of theirs yet. Without a
+    connection it is taken out.
+*/
+
+void rehash_tcb(void) {
+
+    tcb_t **p;
+    int bucket = -1;
+
+    if (tcb->state != S_START && tcb->state != S_CLOSED) {
+        bucket = conn_bucket(tcb->our_port, tcb->their_ipaddr, 
+                             tcb->their_port);
+    }
+    if (bucket == tcb->hash_bucket) {
+        return;
+    }
+
+    if (tcb->hash_bucket != -1) {
+        for (p = &conn_hash[tcb->hash_bucket]; *p != tcb; 
+             p = &(*p)->hash_next) {}
+        *p = tcb->hash_next;
+    }
+
+    tcb->hash_bucket = bucket;
+    if (bucket != -1) {
+        tcb->hash_next = conn_hash[bucket];
+        conn_hash[bucket] = tcb;
+    }
+}
+
+
+
+/*
+    Returns the connection a segment from their_ip and their_port to our
+    port is for: the one with that 4-tuple, or else one that listens on
+    the port, for a SYN, or for any segment if it has a backlog. NULL if
+    there is none.
+*/
+
+tcb_t *find_tcb(tcp_u16t our_port, ipaddr_t their_ip, tcp_u16t their_port,
+                tcp_u8t flags) {
+
+    tcb_t *conn;
+
+    for (conn = conn_hash[conn_bucket(our_port, their_ip, their_port)];
+         conn != NULL; conn = conn->hash_next) {
+        if (conn->our_port == our_port && conn->their_port == their_port &&
+            conn->their_ipaddr == their_ip) {
+            return conn;
         }
-        
-    } else if (tcb.state == S_ESTABLISHED) {
-        
-        if ( (tcb.their_previous_seq_nr == seq_nr) &&
-             (tcb.their_previous_flags & SYN_FLAG) ) {
-            /* we got a duplicate on our hands; send ack again */
-            send_ack();
+    }
+
+    for (conn = conn_hash[conn_bucket(our_port, 0, 0)];
+         conn != NULL; conn = conn->hash_next) {
+        if (conn->our_port == our_port && conn->state == S_LISTEN &&
+            (conn->listener != NULL ||
+             ((flags & SYN_FLAG) && !(flags & ACK_FLAG)))) {
+            return conn;
         }
-        
     }
+    return NULL;
 }
 
 
-void handle_fin(tcp_u8t flags, tcp_u32t seq_nr) {
-    int s;
-    if (FIN_FLAG & flags) {
-        
-        s = tcb.state;
-        
-        if (s == S_ESTABLISHED || s == S_FIN_WAIT_1 || s == S_FIN_WAIT_2) {
-        
-            tcb.their_seq_nr = seq_nr + 1;
-            tcb.ack_nr = seq_nr + 1;
-            send_ack();
-            declare_event(E_FIN_RECEIVED);
-            
-        } else if (s == S_CLOSE_WAIT || s == S_LAST_ACK) {
-        
-            /* we already received a fin; let's see if it's a duplicate */
-            if ( (tcb.their_previous_seq_nr == seq_nr) &&
-                 (tcb.their_previous_flags & FIN_FLAG) ) {
-                 /* yes, it's a duplicate; ack it again */
-                 send_ack();
+
+void tcp_alarm(int sig){
+    alarm_went_off = 1;
+}
+
+
+/*
+    Gives the user back the SIGALRM handler oldsig, which a call took
+    over, and hands it the alarm that went off meanwhile
+*/
+
+void restore_alarm(void (*oldsig)(int)) {
+
+    signal(SIGALRM, oldsig);
+    if (alarm_went_off) {
+        alarm_went_off = 0;
+        raise(SIGALRM);
+    }
+}
+
+
+
+/*
+    The receiver thread of start_receiver(): waits in ip_receive(), and
+    queues what comes in for do_packet(). A queue that gets its first
+    packet makes both pipes readable. If the queue is full, the packet
+    is dropped, and resent by them.
+*/
+
+void *receive_packets(void *arg) {
+
+    rx_packet_t p;
+    sigset_t all;
+    int queued;
+
+    /* the signals are for the thread of the application */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    for (;;) {
+
+        p.proto = 0;
+        p.len = ip_receive(&p.src, &p.dst, &p.proto, &p.id, &p.data);
+        if (p.len == -1) {
+            continue;
+        }
+
+        pthread_mutex_lock(&rx_lock);
+        queued = rx_count < RX_QUEUE_SIZE;
+        if (queued) {
+            rx_queue[(rx_head + rx_count) % RX_QUEUE_SIZE] = p;
+            if (rx_count++ == 0) {
+                notify(event_pipe[1]);
+                notify(wake_pipe[1]);
             }
         }
-    }   
+        pthread_mutex_unlock(&rx_lock);
+
+        if (!queued) {
+            free(p.data);
+        }
+    }
+    return NULL;
 }
 
 
 
 /*
-  buf       Buffer with bytes to send
-  len       Number of bytes to send
-
-  Returns number of bytes sent, or -1 on error.
+    Takes the next packet like ip_receive() does, but from the receiver
+    thread once there is one, see start_receiver().
+    Returns what ip_receive() returns, -1 if there is no packet yet.
 */
 
-int send_data(const char *buf, int len) {
-    
-    int bytes_sent = 0;
-    char flags = PSH_FLAG | ACK_FLAG;
-    int retransmission_allowed = MAX_RETRANSMISSION;
+int receive_ip(ipaddr_t *src, ipaddr_t *dst, tcp_u16t *proto, tcp_u16t *id,
+               char **data) {
 
-    while (retransmission_allowed--) {
-        bytes_sent = send_tcp_packet(tcb.their_ipaddr, tcb.our_port, 
-            tcb.their_port, tcb.our_seq_nr, tcb.ack_nr, flags, 1, buf, len);
+    rx_packet_t p;
 
-        if(bytes_sent == -1){
-            return -1;
+    if (event_pipe[0] == -1) {
+        return ip_receive(src, dst, proto, id, data);
+    }
 
-        } else {
-            tcb.expected_ack = tcb.our_seq_nr + bytes_sent;
-            tcb.unacked_data_len = bytes_sent;
-        }
-                           
-        if (wait_for_ack()){
-            return bytes_sent;
-        } 
+    pthread_mutex_lock(&rx_lock);
+    if (rx_count == 0) {
+        pthread_mutex_unlock(&rx_lock);
+        return -1;
     }
-    return -1;
+    p = rx_queue[rx_head];
+    rx_head = (rx_head + 1) % RX_QUEUE_SIZE;
+    rx_count--;
+    pthread_mutex_unlock(&rx_lock);
+
+    *src = p.src;
+    *dst = p.dst;
+    *proto = p.proto;
+    *id = p.id;
+    *data = p.data;
+    return p.len;
+}
+
+
+
+/* Returns the nr of packets the receiver thread has queued */
+
+int rx_pending(void) {
+
+    int count;
+
+    pthread_mutex_lock(&rx_lock);
+    count = rx_count;
+    pthread_mutex_unlock(&rx_lock);
+    return count;
 }
 
 
+
 /*
-    Sends a syn packet, and waits for ack.
-    Returns 0, but -1 on error.
+    Waits until the receiver thread has a packet, the first timer is
+    due, or a signal comes, as ip_receive() would
 */
 
-int send_syn(void) {
-    
-    char *buf;
-    char flags = PSH_FLAG | SYN_FLAG;
-    int retransmission_allowed = MAX_RETRANSMISSION;
-    int result;
+void wait_for_packet(void) {
 
-    if (tcb.state != S_CONNECTING) {
-        flags |= ACK_FLAG;
+    struct pollfd pfd;
+    char buf[64];
+    int msec = -1;
+
+    if (rx_pending() > 0) {
+        return;
     }
 
-    while (retransmission_allowed--) {
-    
-        /* send syn packet */
-        result = send_tcp_packet(tcb.their_ipaddr, tcb.our_port, 
-            tcb.their_port, tcb.our_seq_nr, tcb.ack_nr, flags, 1, buf, 0);
-        
-        /* check result */
-        if(result == -1){
-            return -1;
-        } else {
-        
-            tcb.expected_ack = tcb.our_seq_nr + 1;
-            if (flags & ACK_FLAG) {
-                declare_event(E_SYN_ACK_SENT);
-            } else {
-                declare_event(E_SYN_SENT);
-            }
-        }
-        
-        /* wait for ack */          
-        if (wait_for_ack() && tcb.state == S_ESTABLISHED){
-            return 0;
-        } else {
-            declare_event(E_ACK_TIME_OUT);
-        }
+    if (wheel_timers > 0) {
+        msec = (max((int) (wheel_next() - wheel_ticks()), 0) * TIMER_TICK
+                + 999) / 1000;
     }
-    declare_event(E_PARTNER_DEAD);
-    return -1;
+
+    pfd.fd = wake_pipe[0];
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, msec) > 0) {
+        while (read(wake_pipe[0], buf, sizeof(buf)) > 0) {}
+    }
+}
+
+
+
+/* Returns 1 if a timer on the wheel is due, 0 otherwise */
+
+int timers_due(void) {
+
+    return wheel_timers > 0 && (int) (wheel_next() - wheel_ticks()) <= 0;
+}
+
+
+
+/* event_timer went off, in a thread of its own; see tcp_process_events() */
+
+void timer_due(union sigval value) {
+
+    notify(event_pipe[1]);
 }
 
 
 
 /*
-    Sends a fin packet, and waits for ack.
-    Returns 0, but -1 on error.
+    Sets event_timer to make event_pipe readable when the first timer
+    on the wheel is due, see tcp_process_events()
 */
 
-int send_fin(void) {
-    
-    char *buf;
-    char flags = PSH_FLAG | FIN_FLAG | ACK_FLAG;
-    int retransmission_allowed = MAX_RETRANSMISSION;
-    int result;
+void arm_event_timer(void) {
 
-    while (retransmission_allowed--) {
-    
-        /* send fin packet */
-        result = send_tcp_packet(tcb.their_ipaddr, tcb.our_port, 
-            tcb.their_port, tcb.our_seq_nr, tcb.ack_nr, flags, 1, buf, 0);
-        
-        /* check result */
-        if(result == -1){
-            return -1;
-        } else {
-            tcb.expected_ack = tcb.our_seq_nr + 1;
-        }
-        
-        /* wait for ack */          
-        if (wait_for_ack() && tcb.state != S_FIN_WAIT_1){
-            return 0;
-        }
+    struct itimerspec when;
+    long usec;
+
+    memset(&when, 0, sizeof(when));
+    if (wheel_timers > 0) {
+        usec = (long) max((int) (wheel_next() - wheel_ticks()), 1) 
+               * TIMER_TICK;
+        when.it_value.tv_sec = usec / 1000000;
+        when.it_value.tv_nsec = usec % 1000000 * 1000;
     }
-    declare_event(E_PARTNER_DEAD);
-    return -1;
+    timer_settime(event_timer, 0, &when, NULL);
 }
 
 
+
 /*
-    Sends an ack packet.
-    Returns 0, but -1 on error.
+    The thread of tcp_engine_start(): handles the events of tcp_fileno()
+    as they come, whenever the application is not in a call
 */
 
-int send_ack(void) {
+void *run_engine(void *arg) {
 
-    char *buf;
-    char flags = PSH_FLAG | ACK_FLAG;
+    struct pollfd pfd;
+    sigset_t all;
 
-    flags |= PSH_FLAG;
-    flags |= ACK_FLAG;
+    /* the signals are for the thread of the application */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
 
-    return send_tcp_packet(tcb.their_ipaddr, tcb.our_port, 
-            tcb.their_port, tcb.our_seq_nr, tcb.ack_nr, flags, 1, buf, 0);
+    pfd.fd = event_pipe[0];
+    pfd.events = POLLIN;
+    for (;;) {
+        if (poll(&pfd, 1, -1) > 0) {
+            tcp_process_events();
+        }
+    }
+    return NULL;
 }
 
 
 
-int wait_for_ack(void){
+/* Takes the stack lock for a call, once the engine runs */
 
-    void (*oldsig)(int);
-    unsigned oldtimo;
+void engine_lock(void) {
 
-    alarm_went_off = 0;
-    oldsig = signal(SIGALRM, tcp_alarm);
-    oldtimo = alarm(RTT);
-    
-    while (alarm_went_off == 0 && !all_acks_received()) {
-        do_packet();
+    if (engine_running) {
+        pthread_mutex_lock(&stack_lock);
+        engine_depth++;
     }
-
-    signal(SIGALRM, oldsig);    
-    alarm(oldtimo);
-    alarm_went_off = 0;
-    
-    return all_acks_received();
 }
 
-/* Check validity of ports, flags, seq nr and ack nr.
-   returns 0 on error, 1 on succes */ 
 
-int packet_is_valid(tcp_u32t seq_nr, tcp_u32t ack_nr, tcp_u8t flags,
-                    tcp_u16t src_port, tcp_u16t dst_port, int data_sz) {
 
-    tcp_u32t diff;
-    
-    /* only accept packet if it belongs to current socket */
-    if (dst_port != tcb.our_port || src_port != tcb.their_port) {
-        return 0;
-    }
-    
-    if (tcb.state == S_LISTEN) {
-    
-        if ( !(flags & SYN_FLAG) || (flags & ACK_FLAG) ) {
-            /* in this state accept syn, but no ack */
-            return 0;
-        }
-    }
-    
-    if (tcb.state == S_SYN_SENT) {
-        /* in this state only accept syn+ack packets */
-        if ( !(flags & ACK_FLAG) || !(flags & SYN_FLAG)) {
-            return 0;
-        }
-        /* is this a reasonable ack number? */
-        diff = tcb.expected_ack - ack_nr;
-        if ( diff > MAX_TCP_DATA ) {
-            return 0;
-        }
+/*
+    Gives the stack lock back. A call may have started timers, which the
+    engine has to wake for.
+*/
+
+void engine_unlock(void) {
+
+    if (!engine_running) {
+        return;
     }
-    
-    /* check seq and ack only if this is not a syn packet */
-    if ( !(flags & SYN_FLAG) ) {
-        /*    todo: check sequence number */
-        
-        if ( !(flags & ACK_FLAG) ) {
-            return 0;
-        }
-        
-        /* is this a reasonable ack number? */
-        diff = tcb.expected_ack - ack_nr;
-        if ( diff > MAX_TCP_DATA ) {
-            return 0;
-        }    
-    } 
-    
-    
-    /* we don't handle data in a syn/fin packet */
-    if ( (flags & SYN_FLAG) || (flags & FIN_FLAG) ) {
-        if (data_sz > 0) {
-            return 0;
+    if (--engine_depth == 0) {
+        if (tcb != NULL) {
+            arm_timers();
         }
+        arm_event_timer();
     }
-    
-    if (data_sz > MAX_TCP_DATA){
-        return 0;
-    }
-    
-    return 1;
+    pthread_mutex_unlock(&stack_lock);
 }
 
 
-void clear_tcb(void) {
-
-    /* fast forward dirty seq_nr if the last packet wasn't acked. */
-    tcb.our_seq_nr += tcb.unacked_data_len;
-    /* clear some variables */
-    tcb.their_seq_nr = 0;
-    tcb.their_ipaddr = 0;
-    tcb.their_port = 0;
-    tcb.rcvd_data_start = 0;
-    tcb.rcvd_data_size = 0;
-    tcb.unacked_data_len = 0;
-}
 
+/* Makes the pipe with write end fd readable */
 
+void notify(int fd) {
 
-void tcp_alarm(int sig){
-    alarm_went_off = 1;
+    if (write(fd, "", 1) == -1) {
+        /* it is full, so readable already */
+    }
 }
 
 
@@ -862,77 +5181,87 @@ void declare_event(event_t e) {
     int error = 0;
     int s;
     
-    s = tcb.state;
+    s = tcb->state;
 
     if (s == S_START && e == E_SOCKET_OPEN) {
-        tcb.state = S_CLOSED;
+        tcb->state = S_CLOSED;
 
     } else if (e == E_SOCKET_OPEN) {
         /* reset connection */
-        tcb.state = S_CLOSED;
+        tcb->state = S_CLOSED;
         clear_tcb();
         
     } else if (s == S_CLOSED && e == E_CONNECT) {
-        tcb.state = S_CONNECTING;
+        tcb->state = S_CONNECTING;
         
     } else if (s == S_CLOSED && e == E_LISTEN) {
-        tcb.state = S_LISTEN;
+        tcb->state = S_LISTEN;
 
     } else if (s == S_CONNECTING && e == E_SYN_SENT) {
-        tcb.state = S_SYN_SENT;
+        tcb->state = S_SYN_SENT;
         
+    } else if (s == S_CLOSED && e == E_ACCEPTED) {
+        /* the handshake was in the backlog of a listener */
+        tcb->state = S_ESTABLISHED;
+
     } else if (s == S_SYN_SENT && e == E_SYN_ACK_RECEIVED) {
-        tcb.state = S_ESTABLISHED;
+        tcb->state = S_ESTABLISHED;
 
     } else if (s == S_SYN_SENT && e == E_ACK_TIME_OUT) {
-        tcb.state = S_CONNECTING;
+        tcb->state = S_CONNECTING;
         
     } else if (s == S_LISTEN && e == E_SYN_RECEIVED) {
-        tcb.state = S_SYN_RECEIVED;
+        tcb->state = S_SYN_RECEIVED;
         
     } else if (s == S_SYN_RECEIVED && e == E_SYN_ACK_SENT) {
-        tcb.state = S_SYN_ACK_SENT;
+        tcb->state = S_SYN_ACK_SENT;
 
     } else if (s == S_SYN_ACK_SENT && e == E_ACK_RECEIVED) {
-        tcb.state = S_ESTABLISHED;
+        tcb->state = S_ESTABLISHED;
 
     } else if (s == S_SYN_ACK_SENT && e == E_ACK_TIME_OUT) {
-        tcb.state = S_SYN_RECEIVED;
+        tcb->state = S_SYN_RECEIVED;
+
+    } else if (s == S_SYN_ACK_SENT && e == E_CLOSE) {
+        tcb->state = S_FIN_WAIT_1;
 
     } else if (s == S_ESTABLISHED && e == E_CLOSE) {
-        tcb.state = S_FIN_WAIT_1;
+        tcb->state = S_FIN_WAIT_1;
 
     } else if (s == S_FIN_WAIT_1 && e == E_FIN_RECEIVED) {
-        tcb.state = S_CLOSING;
+        tcb->state = S_CLOSING;
         
     } else if (s == S_FIN_WAIT_1 && e == E_ACK_RECEIVED) {
-        tcb.state = S_FIN_WAIT_2;
+        tcb->state = S_FIN_WAIT_2;
   
     } else if (s == S_FIN_WAIT_2 && e == E_FIN_RECEIVED) {
-        tcb.state = S_CLOSED;
+        tcb->state = S_CLOSED;
         clear_tcb();
         
     } else if (s == S_ESTABLISHED && e == E_FIN_RECEIVED) {
-        tcb.state = S_CLOSE_WAIT;    
+        tcb->state = S_CLOSE_WAIT;    
         
     } else if (s == S_CLOSING && e == E_ACK_RECEIVED) {
-        tcb.state = S_CLOSED;
+        tcb->state = S_CLOSED;
         clear_tcb();
     
     } else if (s == S_CLOSE_WAIT && e == E_CLOSE) {
-        tcb.state = S_LAST_ACK;
+        tcb->state = S_LAST_ACK;
      
     } else if (s == S_LAST_ACK && e == E_ACK_RECEIVED) {
-        tcb.state = S_CLOSED;
+        tcb->state = S_CLOSED;
         clear_tcb();
         
     } else if (e == E_PARTNER_DEAD) {
-        tcb.state = S_CLOSED;
+        tcb->state = S_CLOSED;
         clear_tcb();
         
     } else {
         error = 1;
     }
+
+    /* the 4-tuple or the state changed what do_packet() finds it by */
+    rehash_tcb();
     
 #ifdef DEBUG
     if (error) {
@@ -944,8 +5273,229 @@ void declare_event(event_t e) {
 
 
 
-int all_acks_received(void) { 
-    return tcb.our_seq_nr == tcb.expected_ack;
+/*
+    Writes the options for a segment with these flags to options: our
+    MSS, SACK permitted, our window scale and a timestamp on a SYN (on a
+    SYN-ACK the last three only if they offered them), and Fast Open if
+    we use it (on a SYN-ACK only to give them a cookie). Once agreed on,
+    other segments carry a timestamp, and the out of order ranges we have
+    in the space left.
+    Returns the nr of bytes written, always a multiple of 4.
+*/
+
+int build_options(tcp_u8t flags, char *options) {
+
+    int len;
+
+    if (flags & SYN_FLAG) {
+        options[0] = OPT_MSS;
+        options[1] = 4;
+        options[2] = (tcb->rcv_mss >> 8) & 0xff;
+        options[3] = tcb->rcv_mss & 0xff;
+        len = 4;
+        if (!(flags & ACK_FLAG) || tcb->sack_ok) {
+            options[len++] = OPT_NOP;
+            options[len++] = OPT_NOP;
+            options[len++] = OPT_SACK_PERMITTED;
+            options[len++] = 2;
+        }
+        if (!(flags & ACK_FLAG) || tcb->wscale_ok) {
+            options[len++] = OPT_NOP;
+            options[len++] = OPT_WSCALE;
+            options[len++] = 3;
+            options[len++] = tcb->rcv_wscale;
+        }
+        if (!(flags & ACK_FLAG) || tcb->ts_ok) {
+            len += build_timestamp_option(&options[len], flags);
+        }
+        if (tcb->fastopen && (!(flags & ACK_FLAG) || tcb->tfo_cookie_len > 0)) {
+            len += build_fastopen_option(&options[len]);
+        }
+        return len;
+    }
+
+    len = 0;
+    if (tcb->ts_ok) {
+        len += build_timestamp_option(options, flags);
+    }
+    if (tcb->sack_ok && tcb->ooo_count > 0) {
+        len += build_sack_option(&options[len], MAX_TCP_OPTIONS - len);
+    }
+    return len;
+}
+
+
+
+/*
+    Writes a timestamp option with our clock, echoing their latest
+    timestamp; a SYN has nothing to echo yet.
+    Returns the nr of bytes written.
+*/
+
+int build_timestamp_option(char *options, tcp_u8t flags) {
+
+    options[0] = OPT_NOP;
+    options[1] = OPT_NOP;
+    options[2] = OPT_TIMESTAMP;
+    options[3] = 10;
+    put_u32(&options[4], ts_now());
+    put_u32(&options[8], (flags & ACK_FLAG) ? tcb->ts_recent : 0);
+    return 12;
+}
+
+
+
+/*
+    Writes a Fast Open option with tcb->tfo_cookie, or without a cookie to
+    ask for one.
+    Returns the nr of bytes written.
+*/
+
+int build_fastopen_option(char *options) {
+
+    int len, pad;
+
+    /* NOPs in front, to fill whole 32 bit words */
+    len = (2 + tcb->tfo_cookie_len + 3) & ~3;
+    pad = len - 2 - tcb->tfo_cookie_len;
+    memset(options, OPT_NOP, pad);
+
+    options[pad] = OPT_FASTOPEN;
+    options[pad + 1] = 2 + tcb->tfo_cookie_len;
+    memcpy(&options[pad + 2], tcb->tfo_cookie, tcb->tfo_cookie_len);
+    return len;
+}
+
+
+
+/*
+    Writes a SACK option with as many out of order ranges as fit in space
+    bytes. The range holding the latest out of order segment goes first
+    (RFC 2018), the others follow in order.
+    Returns the nr of bytes written.
+*/
+
+int build_sack_option(char *options, int space) {
+
+    int i, first = 0, n = 0, max_blocks;
+    char *p = &options[4];
+
+    max_blocks = min(MAX_SACK_BLOCKS, (space - 4) / 8);
+    if (max_blocks <= 0) {
+        return 0;
+    }
+
+    for (i = 0; i < tcb->ooo_count; i++) {
+        if (SEQ_LEQ(tcb->ooo[i].start, tcb->ooo_last) &&
+            SEQ_LT(tcb->ooo_last, tcb->ooo[i].end)) {
+            first = i;
+        }
+    }
+
+    put_u32(p, tcb->ooo[first].start);
+    put_u32(p + 4, tcb->ooo[first].end);
+    p += 8;
+    n++;
+
+    for (i = 0; i < tcb->ooo_count && n < max_blocks; i++) {
+        if (i != first) {
+            put_u32(p, tcb->ooo[i].start);
+            put_u32(p + 4, tcb->ooo[i].end);
+            p += 8;
+            n++;
+        }
+    }
+
+    options[0] = OPT_NOP;
+    options[1] = OPT_NOP;
+    options[2] = OPT_SACK;
+    options[3] = 2 + 8 * n;
+    return 4 + 8 * n;
+}
+
+
+
+/*
+    Reads the options we know from the len bytes in options into opts,
+    skipping the others. Stops at the first malformed option.
+*/
+
+void parse_options(const char *options, int len, tcp_options_t *opts) {
+
+    int i = 0, opt_len, j;
+
+    memset(opts, 0, sizeof(tcp_options_t));
+
+    while (i < len) {
+
+        if (options[i] == OPT_EOL) {
+            break;
+        }
+        if (options[i] == OPT_NOP) {
+            i++;
+            continue;
+        }
+        if (i + 1 >= len) {
+            break;
+        }
+        opt_len = (tcp_u8t) options[i + 1];
+        if (opt_len < 2 || i + opt_len > len) {
+            break;
+        }
+
+        if (options[i] == OPT_MSS && opt_len == 4) {
+            opts->mss = ((tcp_u8t) options[i + 2] << 8) | 
+                        (tcp_u8t) options[i + 3];
+
+        } else if (options[i] == OPT_TIMESTAMP && opt_len == 10) {
+            opts->ts_ok = 1;
+            opts->tsval = get_u32(&options[i + 2]);
+            opts->tsecr = get_u32(&options[i + 6]);
+
+        } else if (options[i] == OPT_WSCALE && opt_len == 3) {
+            opts->wscale_ok = 1;
+            opts->wscale = (tcp_u8t) options[i + 2];
+
+        } else if (options[i] == OPT_FASTOPEN) {
+            opts->tfo_ok = 1;
+            if (opt_len - 2 >= TFO_COOKIE_MIN && 
+                opt_len - 2 <= TFO_COOKIE_MAX) {
+                opts->tfo_cookie_len = opt_len - 2;
+                memcpy(opts->tfo_cookie, &options[i + 2], opt_len - 2);
+            }
+
+        } else if (options[i] == OPT_SACK_PERMITTED && opt_len == 2) {
+            opts->sack_permitted = 1;
+
+        } else if (options[i] == OPT_SACK && (opt_len - 2) % 8 == 0) {
+            for (j = i + 2; j < i + opt_len && 
+                    opts->sack_count < MAX_SACK_BLOCKS; j += 8) {
+                opts->sack[opts->sack_count].start = get_u32(&options[j]);
+                opts->sack[opts->sack_count].end = get_u32(&options[j + 4]);
+                opts->sack_count++;
+            }
+        }
+        i += opt_len;
+    }
+}
+
+
+
+/* network byte order, without alignment requirements */
+
+void put_u32(char *p, tcp_u32t value) {
+    p[0] = (value >> 24) & 0xff;
+    p[1] = (value >> 16) & 0xff;
+    p[2] = (value >> 8) & 0xff;
+    p[3] = value & 0xff;
+}
+
+
+tcp_u32t get_u32(const char *p) {
+    return ((tcp_u32t) (tcp_u8t) p[0] << 24) | 
+           ((tcp_u32t) (tcp_u8t) p[1] << 16) |
+           ((tcp_u32t) (tcp_u8t) p[2] << 8) | 
+           (tcp_u32t) (tcp_u8t) p[3];
 }
 
 /* ----------------------------------- */
@@ -960,6 +5510,8 @@ int send_tcp_packet(ipaddr_t dst,
         tcp_u32t ack_nr, 
         tcp_u8t flags, 
         tcp_u16t win_sz, 
+        const char *options,
+        int options_sz,
         const char *data, 
         int data_sz) {
     
@@ -968,7 +5520,13 @@ int send_tcp_packet(ipaddr_t dst,
     tcp_hdr_t *tcp;
     char segment[MAX_TCP_SEGMENT_LEN];
 
-    hdr_sz = sizeof(tcp_hdr_t);
+    /* options must fill whole 32 bit words */
+    if (options_sz < 0 || options_sz > MAX_TCP_OPTIONS || options_sz & 3 ||
+        data_sz < 0 || data_sz > MAX_TCP_DATA) {
+        return -1;
+    }
+
+    hdr_sz = TCP_HDR + options_sz;
     tcp_sz = hdr_sz + data_sz;
     tcp = (tcp_hdr_t *) segment;
 
@@ -982,6 +5540,7 @@ int send_tcp_packet(ipaddr_t dst,
     tcp->checksum = 0x00;
     tcp->urg_pointer = 0;
 
+    memcpy(&segment[TCP_HDR], options, options_sz);
     memcpy(&segment[hdr_sz], data, data_sz);
     
     tcp->checksum = tcp_checksum(my_ipaddr, dst, tcp, tcp_sz);
@@ -1004,6 +5563,8 @@ int recv_tcp_packet(ipaddr_t *src_ip,
         tcp_u32t *ack_nr, 
         tcp_u8t *flags,
         tcp_u16t *win_sz, 
+        char *options,
+        int *options_sz,
         char *data, 
         int *data_sz) {
     
@@ -1017,7 +5578,7 @@ int recv_tcp_packet(ipaddr_t *src_ip,
 
 
     proto = 0;
-    len = ip_receive(src_ip, &dst_ip, &proto, &id, &segment);
+    len = receive_ip(src_ip, &dst_ip, &proto, &id, &segment);
         
     if ( len == -1 || proto != IP_PROTO_TCP ){
         return -1;
@@ -1025,7 +5586,7 @@ int recv_tcp_packet(ipaddr_t *src_ip,
     
     tcp = (tcp_hdr_t *) segment;
     
-    chksm = tcp_checksum(*src_ip, tcb.our_ipaddr, tcp, len);
+    chksm = tcp_checksum(*src_ip, my_ipaddr, tcp, len);
     if (chksm) {
         return -1;
     }
@@ -1038,8 +5599,15 @@ int recv_tcp_packet(ipaddr_t *src_ip,
     *win_sz   = ntohs(tcp->win_sz);
         
     hdr_sz = (tcp->data_offset) >> 2;
+    if (hdr_sz < TCP_HDR || (int)hdr_sz > len || 
+        len - (int)hdr_sz > MAX_TCP_DATA) {
+        free(segment);
+        return -1;
+    }
+    *options_sz = hdr_sz - TCP_HDR;
     *data_sz = len - (int)hdr_sz;
     
+    memcpy(options, &segment[TCP_HDR], *options_sz);
     memcpy(data, &segment[(int)hdr_sz], *data_sz);
     free(segment);
     return *data_sz;
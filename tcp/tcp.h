@@ -13,26 +13,125 @@
 #define IP_HEADER_LEN 20
 #define TCP_PSEUDO_HDR 12
 #define TCP_HDR 20
+#define MAX_TCP_OPTIONS 40
 #define MAX_TCP_SEGMENT_LEN (MAX_IP_PACKET_LEN - IP_HEADER_LEN)
-#define MAX_TCP_DATA (MAX_TCP_SEGMENT_LEN - TCP_HDR)
+#define MAX_TCP_DATA (MAX_TCP_SEGMENT_LEN - TCP_HDR - MAX_TCP_OPTIONS)
+#define DEFAULT_MSS 536     /* if they don't announce theirs (RFC 9293) */
+#define MIN_MSS 64          /* smallest segment size we go along with */
 #define MAX_RETRANSMISSION 10
-#define BUFFER_SIZE 64000
+#define DUPACK_THRESHOLD 3  /* duplicate acks that trigger fast retransmit */
+#define BUFFER_SIZE 64000   /* default send and receive buffer */
+#define MAX_BUFFER_SIZE (16 * 1024 * 1024) /* largest, see tcp_set_rcvbuf() */
+#define MAX_WSCALE 14       /* largest window shift (RFC 7323) */
+#define MAX_OOO_BLOCKS 16   /* out of order ranges we keep in the buffer */
+#define MAX_SACK_BLOCKS 4   /* ranges in one SACK option */
+#define RTX_QUEUE_SIZE 1024 /* most segments we have in flight at once */
+#define TFO_COOKIE_MAX 12   /* longest Fast Open cookie we keep (RFC 7413) */
+#define MAX_CONNECTIONS 4096 /* descriptors, see tcp_open() */
+#define CONN_HASH_SIZE 4096 /* buckets to find connections by 4-tuple */
+#define SYN_BACKLOG_MAX 128 /* largest backlog, see tcp_listen_backlog() */
+#define RX_QUEUE_SIZE 256   /* packets the receiver thread holds, see */
+                            /* tcp_fileno() */
 
-#define RTT 1  /* in seconds */
+/* timers, all in microseconds */
+#define ACK_DELAY 10000       /* longest we hold back an ack */
+#define RTO_INITIAL 1000000
+#define RTO_MIN 20000         /* more than ACK_DELAY, so a delayed ack */
+                              /* doesn't look like a lost segment */
+#define RTO_MAX 60000000
+#define RTO_GRANULARITY 1000  /* clock granularity G of RFC 6298 */
+#define TLP_MIN 10000         /* shortest wait for a tail loss probe */
+#define TS_TICK 1000          /* one tick of the timestamp clock */
+#define TIMER_TICK 100        /* one tick of the timer wheel */
+#define NONBLOCK_WAIT TIMER_TICK /* most a non-blocking call waits for */
+                              /* packets, see tcp_nonblock() */
+
+/* the first call that waits starts a thread of ours that waits in
+   ip_receive(); the calls then poll for its packets until the first
+   timer is due. No signal of the application is touched, but its own
+   SIGALRM still interrupts tcp_listen() and tcp_read(). Link with
+   -lpthread and -lrt, and don't fork() once the stack is in use. */
 
 #define	IP_PROTO_TCP	6
 #define CLIENT_PORT     8042	
 
 typedef unsigned char tcp_u8t;
 typedef unsigned short tcp_u16t;
-typedef unsigned long tcp_u32t;
+typedef unsigned int tcp_u32t;    /* 32 bits, see tcp_hdr_t */
+
+/* a connection to watch with tcp_poll() */
+typedef struct tcp_pollfd {
+    int fd;                 /* its descriptor */
+    short events;           /* the TCP_POLL* events to wait for */
+    short revents;          /* those it is ready for */
+} tcp_pollfd_t;
+
+#define TCP_POLLIN      1   /* tcp_read() doesn't wait */
+#define TCP_POLLOUT     2   /* tcp_write() has room in the send buffer */
+#define TCP_POLLACCEPT  4   /* tcp_accept() has a connection */
+#define TCP_POLLCLOSED  8   /* closed, or they went away; always reported */
 
 int tcp_socket(void);
 int tcp_connect(ipaddr_t dst, int port);
+int tcp_connect_write(ipaddr_t dst, int port, const char *buf, int len);
 int tcp_listen(int port, ipaddr_t *src);
 int tcp_close(void);
 int tcp_write(const char *buf, int len);
+int tcp_write_close(const char *buf, int len);
 int tcp_read(char *buf, int maxlen);
+int tcp_cork(int on);
+int tcp_flush(void);
+int tcp_nodelay(int on);
+int tcp_nonblock(int on);
+long tcp_rto(void);
+int tcp_mss(void);
+int tcp_sack(void);
+int tcp_set_mss(int mss);
+int tcp_set_rcvbuf(int size);
+int tcp_set_sndbuf(int size);
+int tcp_congestion(const char *name);
+int tcp_fastopen(int on);
+int tcp_fastopen_cookie(ipaddr_t dst, char *cookie);
+int tcp_set_fastopen_cookie(ipaddr_t dst, const char *cookie, int len);
+
+/* the same on the connection with descriptor fd */
+int tcp_open(void);
+int tcp_release(int fd);
+int tcp_socket_fd(int fd);
+int tcp_connect_fd(int fd, ipaddr_t dst, int port);
+int tcp_connect_write_fd(int fd, ipaddr_t dst, int port, const char *buf,
+                         int len);
+int tcp_listen_fd(int fd, int port, ipaddr_t *src);
+int tcp_listen_backlog(int fd, int port, int backlog);
+int tcp_accept(int fd, ipaddr_t *src);
+int tcp_close_fd(int fd);
+int tcp_write_fd(int fd, const char *buf, int len);
+int tcp_write_close_fd(int fd, const char *buf, int len);
+int tcp_read_fd(int fd, char *buf, int maxlen);
+int tcp_cork_fd(int fd, int on);
+int tcp_flush_fd(int fd);
+int tcp_nodelay_fd(int fd, int on);
+int tcp_nonblock_fd(int fd, int on);
+long tcp_rto_fd(int fd);
+int tcp_mss_fd(int fd);
+int tcp_sack_fd(int fd);
+int tcp_set_mss_fd(int fd, int mss);
+int tcp_set_rcvbuf_fd(int fd, int size);
+int tcp_set_sndbuf_fd(int fd, int size);
+int tcp_congestion_fd(int fd, const char *name);
+int tcp_fastopen_fd(int fd, int on);
+
+/* the same, but instead of a SIGALRM, the deadline stops the wait; a
+   deadline is a time of tcp_now(), e.g. tcp_now() + 5000000 */
+int tcp_listen_deadline(int fd, int port, ipaddr_t *src, tcp_u32t deadline);
+int tcp_write_deadline(int fd, const char *buf, int len, tcp_u32t deadline);
+int tcp_read_deadline(int fd, char *buf, int maxlen, tcp_u32t deadline);
+tcp_u32t tcp_now(void);
+
+int tcp_poll(tcp_pollfd_t *fds, int nfds, long timeout);
+int tcp_fileno(void);
+int tcp_process_events(void);
+int tcp_engine_start(void);
 
 int send_tcp_packet(ipaddr_t dst, 
         tcp_u16t src_port,
@@ -41,6 +140,8 @@ int send_tcp_packet(ipaddr_t dst,
         tcp_u32t  ack_nr, 
         tcp_u8t flags, 
         tcp_u16t win_sz, 
+        const char *options,
+        int options_sz,
         const char *data, 
         int data_sz);
 
@@ -51,6 +152,8 @@ int recv_tcp_packet(ipaddr_t *src,
         tcp_u32t *ack_nr, 
         tcp_u8t *flags,
         tcp_u16t *win_z, 
+        char *options,
+        int *options_sz,
         char *data, 
         int *data_sz);
 
@@ -0,0 +1,159 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include "tcp.h"
+
+/*
+  Test cork.c
+
+  Standard listen and connect. The client corks, writes a
+  message one byte at a time, and uncorks; the server must
+  get the whole message in one read. Close.
+*/
+
+
+static void alarm_handler(int sig) {
+    /* just return to interrupt */
+}
+
+
+int main(void) {
+
+    char server_buf[8];
+    const char *msg = "corked";
+    int i;
+    char *eth, *ip1, *ip2;
+
+    int pid, status;
+
+    ipaddr_t saddr;
+
+    eth = getenv("ETH");
+    if (!eth) {
+        fprintf(stderr, "The ETH environment variable must be set!\n");
+        return 1;
+    }
+
+    ip1 = getenv("IP1");
+    ip2 = getenv("IP2");
+    if ((!ip1)||(!ip2)) {
+        fprintf(stderr, "The IP1 and IP2 environment variables must be set!\n");
+        return 1;
+    }
+
+    pid = fork();
+
+    if (pid == -1) {
+        fprintf(stderr, "Unable to fork client process\n");
+        return 1;
+    }
+
+    if (pid == 0) {
+
+        /* Client process running in $IP1 */
+
+        eth[0] = '1';
+
+        if (tcp_socket() != 0) {
+            fprintf(stderr, "Client: Opening socket failed\n");
+            return 1;
+        }
+
+        if (tcp_connect(inet_aton(ip2), 80) != 0) {
+            fprintf(stderr, "Client: Connecting to server failed\n");
+            return 1;
+        }
+
+        if (tcp_cork(1) != 0) {
+            fprintf(stderr, "Client: Corking failed\n");
+            return 1;
+        }
+
+        for (i = 0; i < 7; i++) {
+            if (tcp_write(&msg[i], 1) != 1) {
+                fprintf(stderr, "Client: Writing 1 byte failed\n");
+                return 1;
+            }
+        }
+
+        if (tcp_cork(0) != 0) {
+            fprintf(stderr, "Client: Uncorking failed\n");
+            return 1;
+        }
+
+        if (tcp_close() != 0) {
+            fprintf(stderr, "Client: Closing connection failed\n");
+            return 1;
+        }
+
+        signal(SIGALRM, alarm_handler);
+        alarm(5);
+
+        while (tcp_read(server_buf, 4) > 0) {}
+
+        alarm(0);
+
+        return 0;
+
+    } else {
+
+        /* Server process running in $IP2 */
+
+        eth[0]='2';
+        /*ip_init();*/
+
+        if (tcp_socket() != 0) {
+            fprintf(stderr, "Server: Opening socket failed\n");
+            return 1;
+        }
+
+        signal(SIGALRM, alarm_handler);
+        alarm(5);
+
+        if (tcp_listen(80, &saddr) < 0) {
+            fprintf(stderr, "Server: Listening for client failed\n");
+            return 1;
+        }
+
+        alarm(0);
+
+        signal(SIGALRM, alarm_handler);
+        alarm(5);
+
+        if (tcp_read(server_buf, 8) != 7) {
+            fprintf(stderr, "Server: Reading 7 bytes at once failed\n");
+            return 1;
+        }
+
+        alarm(0);
+
+        if (strcmp(server_buf, "corked")) {
+            fprintf(stderr, "Server: Reading 'corked' failed\n");
+            return 1;
+        }
+
+        if (tcp_close() != 0) {
+            fprintf(stderr, "Server: Closing connection failed\n");
+            return 1;
+        }
+
+        signal(SIGALRM, alarm_handler);
+        alarm(5);
+
+        while (tcp_read(server_buf, 4) > 0) {}
+
+        alarm(0);
+
+        /* Wait for client process to finish */
+        while (wait(&status) != pid);
+
+        return 0;
+
+    }
+
+
+}
@@ -0,0 +1,207 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include "tcp.h"
+
+#define BUF_SIZE 20000
+#define ROUNDS 2
+
+/*
+  Test fast_open.c
+
+  The client connects twice with Fast Open on. The first time it
+  gets a cookie, the second time its request goes with the SYN, and
+  the rest of it after the handshake. The cookie must survive the
+  handshake whole, and stay the same for the second connection. Each
+  time the server must read the whole request and answer it with its
+  FIN.
+*/
+
+
+static void alarm_handler(int sig) {
+    /* just return to interrupt */
+}
+
+
+int main(void) {
+
+    char server_buf[BUF_SIZE], client_buf[BUF_SIZE];
+    char cookie[TFO_COOKIE_MAX], first_cookie[TFO_COOKIE_MAX];
+    char *eth, *ip1, *ip2;
+
+    int pid, status, total, read, round, j, len, first_len = 0;
+
+    ipaddr_t saddr;
+
+    eth = getenv("ETH");
+    if (!eth) {
+        fprintf(stderr, "The ETH environment variable must be set!\n");
+        return 1;
+    }
+
+    ip1 = getenv("IP1");
+    ip2 = getenv("IP2");
+    if ((!ip1)||(!ip2)) {
+        fprintf(stderr, "The IP1 and IP2 environment variables must be set!\n");
+        return 1;
+    }
+
+    pid = fork();
+
+    if (pid == -1) {
+        fprintf(stderr, "Unable to fork client process\n");
+        return 1;
+    }
+
+    if (pid == 0) {
+
+        /* Client process running in $IP1 */
+
+        eth[0] = '1';
+
+        for (j = 0; j < BUF_SIZE; j++) {
+            client_buf[j] = (j % 8) + 48;
+        }
+
+        if (tcp_fastopen_cookie(inet_aton(ip2), cookie) != 0) {
+            fprintf(stderr, "Client: Cookie before connecting\n");
+            return 1;
+        }
+
+        for (round = 0; round < ROUNDS; round++) {
+
+            if (tcp_socket() != 0) {
+                fprintf(stderr, "Client: Opening socket failed\n");
+                return 1;
+            }
+
+            tcp_fastopen(1);
+
+            if (tcp_connect_write(inet_aton(ip2), 80, client_buf, BUF_SIZE)
+                != BUF_SIZE) {
+                fprintf(stderr, "Client: Connecting and writing failed\n");
+                return 1;
+            }
+
+            len = tcp_fastopen_cookie(inet_aton(ip2), cookie);
+            if (len == 0) {
+                fprintf(stderr, "Client: Server gave no cookie\n");
+                return 1;
+            }
+            if (len < 4 || len > TFO_COOKIE_MAX) {
+                fprintf(stderr, "Client: Cookie of %d bytes\n", len);
+                return 1;
+            }
+            if (round == 0) {
+                memcpy(first_cookie, cookie, len);
+                first_len = len;
+            } else if (len != first_len || memcmp(cookie, first_cookie, len)) {
+                fprintf(stderr, "Client: Cookie changed in round %d\n", round);
+                return 1;
+            }
+
+            signal(SIGALRM, alarm_handler);
+            alarm(5);
+
+            if (tcp_read(server_buf, 4) != 4 || strcmp(server_buf, "bar")) {
+                fprintf(stderr, "Client: Reading 'bar' failed\n");
+                return 1;
+            }
+
+            if (tcp_read(server_buf, 4) != 0) {
+                fprintf(stderr, "Client: Server did not close\n");
+                return 1;
+            }
+
+            alarm(0);
+
+            if (tcp_close() != 0) {
+                fprintf(stderr, "Client: Closing connection failed\n");
+                return 1;
+            }
+
+            signal(SIGALRM, alarm_handler);
+            alarm(5);
+
+            while (tcp_read(server_buf, 4) > 0) {}
+
+            alarm(0);
+        }
+
+        return 0;
+
+    } else {
+
+        /* Server process running in $IP2 */
+
+        eth[0]='2';
+
+        for (round = 0; round < ROUNDS; round++) {
+
+            if (tcp_socket() != 0) {
+                fprintf(stderr, "Server: Opening socket failed\n");
+                return 1;
+            }
+
+            tcp_fastopen(1);
+
+            signal(SIGALRM, alarm_handler);
+            alarm(5);
+
+            if (tcp_listen(80, &saddr) < 0) {
+                fprintf(stderr, "Server: Listening for client failed\n");
+                return 1;
+            }
+
+            alarm(0);
+
+            total = 0;
+            while (total < BUF_SIZE) {
+
+                signal(SIGALRM, alarm_handler);
+                alarm(5);
+
+                read = tcp_read(&server_buf[total], BUF_SIZE - total);
+                if (read <= 0) {
+                    fprintf(stderr, "Server: Reading failed after %d bytes\n",
+                            total);
+                    return 1;
+                }
+                total += read;
+
+                alarm(0);
+            }
+
+            for (j = 0; j < BUF_SIZE; j++) {
+                if (server_buf[j] != (j % 8) + 48) {
+                    fprintf(stderr, "Server: Wrong byte at %d\n", j);
+                    return 1;
+                }
+            }
+
+            if (tcp_write_close("bar", 4) != 4) {
+                fprintf(stderr, "Server: Writing 'bar' and closing failed\n");
+                return 1;
+            }
+
+            signal(SIGALRM, alarm_handler);
+            alarm(5);
+
+            while (tcp_read(server_buf, 4) > 0) {}
+
+            alarm(0);
+        }
+
+        /* Wait for client process to finish */
+        while (wait(&status) != pid);
+
+        return 0;
+
+    }
+
+
+}
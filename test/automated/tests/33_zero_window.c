@@ -0,0 +1,204 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include "tcp.h"
+
+#define REQUEST_SIZE 50000
+#define REPLY_SIZE 40000
+#define SERVER_RCVBUF (2 * MAX_TCP_DATA)
+#define PAUSE 1
+
+/*
+  Test zero_window.c
+
+  The server has a small receive buffer, and writes its reply before
+  it reads the request, so its window closes while the client is
+  still writing. The client must probe the window until the server
+  reads, and then finish its request. Both must arrive intact. Close.
+*/
+
+
+static void alarm_handler(int sig) {
+    /* just return to interrupt */
+}
+
+
+int main(void) {
+
+    char server_buf[REQUEST_SIZE], client_buf[REQUEST_SIZE];
+    char *eth, *ip1, *ip2;
+
+    int pid, status, total, read, j;
+
+    ipaddr_t saddr;
+
+    eth = getenv("ETH");
+    if (!eth) {
+        fprintf(stderr, "The ETH environment variable must be set!\n");
+        return 1;
+    }
+
+    ip1 = getenv("IP1");
+    ip2 = getenv("IP2");
+    if ((!ip1)||(!ip2)) {
+        fprintf(stderr, "The IP1 and IP2 environment variables must be set!\n");
+        return 1;
+    }
+
+    pid = fork();
+
+    if (pid == -1) {
+        fprintf(stderr, "Unable to fork client process\n");
+        return 1;
+    }
+
+    if (pid == 0) {
+
+        /* Client process running in $IP1 */
+
+        eth[0] = '1';
+
+        for (j = 0; j < REQUEST_SIZE; j++) {
+            client_buf[j] = (j % 8) + 48;
+        }
+
+        if (tcp_socket() != 0) {
+            fprintf(stderr, "Client: Opening socket failed\n");
+            return 1;
+        }
+
+        if (tcp_connect(inet_aton(ip2), 80) != 0) {
+            fprintf(stderr, "Client: Connecting to server failed\n");
+            return 1;
+        }
+
+        if (tcp_write(client_buf, REQUEST_SIZE) != REQUEST_SIZE) {
+            fprintf(stderr, "Client: Writing failed\n");
+            return 1;
+        }
+
+        total = 0;
+        while (total < REPLY_SIZE) {
+
+            signal(SIGALRM, alarm_handler);
+            alarm(5);
+
+            read = tcp_read(&client_buf[total], REPLY_SIZE - total);
+            if (read <= 0) {
+                fprintf(stderr, "Client: Reading failed after %d bytes\n",
+                        total);
+                return 1;
+            }
+            total += read;
+
+            alarm(0);
+        }
+
+        for (j = 0; j < REPLY_SIZE; j++) {
+            if (client_buf[j] != (j % 7) + 48) {
+                fprintf(stderr, "Client: Wrong byte at %d\n", j);
+                return 1;
+            }
+        }
+
+        if (tcp_close() != 0) {
+            fprintf(stderr, "Client: Closing connection failed\n");
+            return 1;
+        }
+
+        signal(SIGALRM, alarm_handler);
+        alarm(5);
+
+        while (tcp_read(client_buf, 4) > 0) {}
+
+        alarm(0);
+
+        return 0;
+
+    } else {
+
+        /* Server process running in $IP2 */
+
+        eth[0]='2';
+
+        for (j = 0; j < REPLY_SIZE; j++) {
+            server_buf[j] = (j % 7) + 48;
+        }
+
+        if (tcp_socket() != 0) {
+            fprintf(stderr, "Server: Opening socket failed\n");
+            return 1;
+        }
+
+        if (tcp_set_rcvbuf(SERVER_RCVBUF) != 0) {
+            fprintf(stderr, "Server: Setting receive buffer failed\n");
+            return 1;
+        }
+
+        signal(SIGALRM, alarm_handler);
+        alarm(5);
+
+        if (tcp_listen(80, &saddr) < 0) {
+            fprintf(stderr, "Server: Listening for client failed\n");
+            return 1;
+        }
+
+        alarm(0);
+
+        /* the request fills our buffer meanwhile */
+        if (tcp_write(server_buf, REPLY_SIZE) != REPLY_SIZE) {
+            fprintf(stderr, "Server: Writing failed\n");
+            return 1;
+        }
+
+        sleep(PAUSE);
+
+        total = 0;
+        while (total < REQUEST_SIZE) {
+
+            signal(SIGALRM, alarm_handler);
+            alarm(5);
+
+            read = tcp_read(&server_buf[total], REQUEST_SIZE - total);
+            if (read <= 0) {
+                fprintf(stderr, "Server: Reading failed after %d bytes\n",
+                        total);
+                return 1;
+            }
+            total += read;
+
+            alarm(0);
+        }
+
+        for (j = 0; j < REQUEST_SIZE; j++) {
+            if (server_buf[j] != (j % 8) + 48) {
+                fprintf(stderr, "Server: Wrong byte at %d\n", j);
+                return 1;
+            }
+        }
+
+        if (tcp_close() != 0) {
+            fprintf(stderr, "Server: Closing connection failed\n");
+            return 1;
+        }
+
+        signal(SIGALRM, alarm_handler);
+        alarm(5);
+
+        while (tcp_read(server_buf, 4) > 0) {}
+
+        alarm(0);
+
+        /* Wait for client process to finish */
+        while (wait(&status) != pid);
+
+        return 0;
+
+    }
+
+
+}
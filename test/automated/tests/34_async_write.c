@@ -0,0 +1,192 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include "tcp.h"
+
+#define BUF_SIZE 50000
+#define CLIENT_SNDBUF (2 * BUF_SIZE)
+#define PAUSE 1
+
+/*
+  Test async_write.c
+
+  The server doesn't read for a while after the connection is set up.
+  The client's request fits in its send buffer, so tcp_write() must
+  return meanwhile, and the request go out while the client reads.
+  The server must read it intact, and answer it with its FIN. Close.
+*/
+
+
+int alarm_went_off = 0;
+
+static void alarm_handler(int sig) {
+    alarm_went_off = 1;
+}
+
+
+int main(void) {
+
+    char server_buf[BUF_SIZE], client_buf[BUF_SIZE];
+    char *eth, *ip1, *ip2;
+
+    int pid, status, total, read, j;
+
+    ipaddr_t saddr;
+
+    eth = getenv("ETH");
+    if (!eth) {
+        fprintf(stderr, "The ETH environment variable must be set!\n");
+        return 1;
+    }
+
+    ip1 = getenv("IP1");
+    ip2 = getenv("IP2");
+    if ((!ip1)||(!ip2)) {
+        fprintf(stderr, "The IP1 and IP2 environment variables must be set!\n");
+        return 1;
+    }
+
+    pid = fork();
+
+    if (pid == -1) {
+        fprintf(stderr, "Unable to fork client process\n");
+        return 1;
+    }
+
+    if (pid == 0) {
+
+        /* Client process running in $IP1 */
+
+        eth[0] = '1';
+
+        for (j = 0; j < BUF_SIZE; j++) {
+            client_buf[j] = (j % 8) + 48;
+        }
+
+        if (tcp_socket() != 0) {
+            fprintf(stderr, "Client: Opening socket failed\n");
+            return 1;
+        }
+
+        if (tcp_set_sndbuf(CLIENT_SNDBUF) != 0) {
+            fprintf(stderr, "Client: Setting send buffer failed\n");
+            return 1;
+        }
+
+        if (tcp_connect(inet_aton(ip2), 80) != 0) {
+            fprintf(stderr, "Client: Connecting to server failed\n");
+            return 1;
+        }
+
+        signal(SIGALRM, alarm_handler);
+        alarm(PAUSE);
+
+        if (tcp_write(client_buf, BUF_SIZE) != BUF_SIZE) {
+            fprintf(stderr, "Client: Writing failed\n");
+            return 1;
+        }
+
+        alarm(0);
+
+        if (alarm_went_off) {
+            fprintf(stderr, "Client: Writing waited for the server\n");
+            return 1;
+        }
+
+        signal(SIGALRM, alarm_handler);
+        alarm(5);
+
+        if (tcp_read(client_buf, 5) != 5 || strcmp(client_buf, "done")) {
+            fprintf(stderr, "Client: Reading 'done' failed\n");
+            return 1;
+        }
+
+        alarm(0);
+
+        if (tcp_close() != 0) {
+            fprintf(stderr, "Client: Closing connection failed\n");
+            return 1;
+        }
+
+        signal(SIGALRM, alarm_handler);
+        alarm(5);
+
+        while (tcp_read(client_buf, 4) > 0) {}
+
+        alarm(0);
+
+        return 0;
+
+    } else {
+
+        /* Server process running in $IP2 */
+
+        eth[0]='2';
+
+        if (tcp_socket() != 0) {
+            fprintf(stderr, "Server: Opening socket failed\n");
+            return 1;
+        }
+
+        signal(SIGALRM, alarm_handler);
+        alarm(5);
+
+        if (tcp_listen(80, &saddr) < 0) {
+            fprintf(stderr, "Server: Listening for client failed\n");
+            return 1;
+        }
+
+        alarm(0);
+
+        /* the client writes meanwhile */
+        sleep(PAUSE);
+
+        total = 0;
+        while (total < BUF_SIZE) {
+
+            signal(SIGALRM, alarm_handler);
+            alarm(5);
+
+            read = tcp_read(&server_buf[total], BUF_SIZE - total);
+            if (read <= 0) {
+                fprintf(stderr, "Server: Reading failed after %d bytes\n",
+                        total);
+                return 1;
+            }
+            total += read;
+
+            alarm(0);
+        }
+
+        for (j = 0; j < BUF_SIZE; j++) {
+            if (server_buf[j] != (j % 8) + 48) {
+                fprintf(stderr, "Server: Wrong byte at %d\n", j);
+                return 1;
+            }
+        }
+
+        if (tcp_write_close("done", 5) != 5) {
+            fprintf(stderr, "Server: Writing 'done' and closing failed\n");
+            return 1;
+        }
+
+        signal(SIGALRM, alarm_handler);
+        alarm(5);
+
+        while (tcp_read(server_buf, 4) > 0) {}
+
+        alarm(0);
+
+        /* Wait for client process to finish */
+        while (wait(&status) != pid);
+
+        return 0;
+
+    }
+
+
+}
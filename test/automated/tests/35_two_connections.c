@@ -0,0 +1,214 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include "tcp.h"
+
+#define BUF_SIZE 20000
+
+/*
+  Test two_connections.c
+
+  The client opens two connections to the server, to two ports, and
+  writes a request on each. The server reads the second request first,
+  so the first one must wait in its own connection meanwhile. Each
+  request must arrive intact, and each answer on its own connection.
+  Close both.
+*/
+
+
+static void alarm_handler(int sig) {
+    /* just return to interrupt */
+}
+
+
+static int read_all(int fd, char *buf, int len) {
+
+    int total = 0, read;
+
+    while (total < len) {
+
+        signal(SIGALRM, alarm_handler);
+        alarm(5);
+
+        read = tcp_read_fd(fd, &buf[total], len - total);
+        if (read <= 0) {
+            return total;
+        }
+        total += read;
+
+        alarm(0);
+    }
+    return total;
+}
+
+
+static void drain(int fd, char *buf) {
+
+    signal(SIGALRM, alarm_handler);
+    alarm(5);
+
+    while (tcp_read_fd(fd, buf, 4) > 0) {}
+
+    alarm(0);
+}
+
+
+int main(void) {
+
+    char server_buf[BUF_SIZE], client_buf[BUF_SIZE];
+    char *eth, *ip1, *ip2;
+
+    int pid, status, first, second, j;
+
+    ipaddr_t saddr;
+
+    eth = getenv("ETH");
+    if (!eth) {
+        fprintf(stderr, "The ETH environment variable must be set!\n");
+        return 1;
+    }
+
+    ip1 = getenv("IP1");
+    ip2 = getenv("IP2");
+    if ((!ip1)||(!ip2)) {
+        fprintf(stderr, "The IP1 and IP2 environment variables must be set!\n");
+        return 1;
+    }
+
+    pid = fork();
+
+    if (pid == -1) {
+        fprintf(stderr, "Unable to fork client process\n");
+        return 1;
+    }
+
+    if (pid == 0) {
+
+        /* Client process running in $IP1 */
+
+        eth[0] = '1';
+
+        first = tcp_open();
+        second = tcp_open();
+        if (first == -1 || second == -1) {
+            fprintf(stderr, "Client: Opening connections failed\n");
+            return 1;
+        }
+
+        if (tcp_connect_fd(first, inet_aton(ip2), 80) != 0 ||
+            tcp_connect_fd(second, inet_aton(ip2), 81) != 0) {
+            fprintf(stderr, "Client: Connecting to server failed\n");
+            return 1;
+        }
+
+        for (j = 0; j < BUF_SIZE; j++) {
+            client_buf[j] = (j % 8) + 48;
+        }
+        if (tcp_write_fd(first, client_buf, BUF_SIZE) != BUF_SIZE) {
+            fprintf(stderr, "Client: Writing first request failed\n");
+            return 1;
+        }
+
+        for (j = 0; j < BUF_SIZE; j++) {
+            client_buf[j] = (j % 7) + 48;
+        }
+        if (tcp_write_fd(second, client_buf, BUF_SIZE) != BUF_SIZE) {
+            fprintf(stderr, "Client: Writing second request failed\n");
+            return 1;
+        }
+
+        if (read_all(second, client_buf, 4) != 4 ||
+            strcmp(client_buf, "two")) {
+            fprintf(stderr, "Client: Reading 'two' failed\n");
+            return 1;
+        }
+        if (read_all(first, client_buf, 4) != 4 ||
+            strcmp(client_buf, "one")) {
+            fprintf(stderr, "Client: Reading 'one' failed\n");
+            return 1;
+        }
+
+        if (tcp_close_fd(first) != 0 || tcp_close_fd(second) != 0) {
+            fprintf(stderr, "Client: Closing connections failed\n");
+            return 1;
+        }
+
+        drain(first, client_buf);
+        drain(second, client_buf);
+
+        tcp_release(first);
+        tcp_release(second);
+
+        return 0;
+
+    } else {
+
+        /* Server process running in $IP2 */
+
+        eth[0]='2';
+
+        first = tcp_open();
+        second = tcp_open();
+        if (first == -1 || second == -1) {
+            fprintf(stderr, "Server: Opening connections failed\n");
+            return 1;
+        }
+
+        signal(SIGALRM, alarm_handler);
+        alarm(5);
+
+        if (tcp_listen_fd(first, 80, &saddr) < 0 ||
+            tcp_listen_fd(second, 81, &saddr) < 0) {
+            fprintf(stderr, "Server: Listening for client failed\n");
+            return 1;
+        }
+
+        alarm(0);
+
+        if (read_all(second, server_buf, BUF_SIZE) != BUF_SIZE) {
+            fprintf(stderr, "Server: Reading second request failed\n");
+            return 1;
+        }
+        for (j = 0; j < BUF_SIZE; j++) {
+            if (server_buf[j] != (j % 7) + 48) {
+                fprintf(stderr, "Server: Wrong byte at %d of second\n", j);
+                return 1;
+            }
+        }
+
+        if (read_all(first, server_buf, BUF_SIZE) != BUF_SIZE) {
+            fprintf(stderr, "Server: Reading first request failed\n");
+            return 1;
+        }
+        for (j = 0; j < BUF_SIZE; j++) {
+            if (server_buf[j] != (j % 8) + 48) {
+                fprintf(stderr, "Server: Wrong byte at %d of first\n", j);
+                return 1;
+            }
+        }
+
+        if (tcp_write_close_fd(first, "one", 4) != 4 ||
+            tcp_write_close_fd(second, "two", 4) != 4) {
+            fprintf(stderr, "Server: Writing answers and closing failed\n");
+            return 1;
+        }
+
+        drain(first, server_buf);
+        drain(second, server_buf);
+
+        tcp_release(first);
+        tcp_release(second);
+
+        /* Wait for client process to finish */
+        while (wait(&status) != pid);
+
+        return 0;
+
+    }
+
+
+}
@@ -0,0 +1,210 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include "tcp.h"
+
+#define BUF_SIZE 10000
+#define CONNECTIONS 3
+
+/*
+  Test accept.c
+
+  The server listens with a backlog, and the client makes three
+  connections while the server is still waiting for the first one in
+  tcp_accept(). The server accepts them all, reads the requests in
+  reverse order and answers each on its own connection; the request
+  says which one it is, as a lost ack may change the order in which
+  the handshakes complete. Close all.
+*/
+
+
+static void alarm_handler(int sig) {
+    /* just return to interrupt */
+}
+
+
+static int read_all(int fd, char *buf, int len) {
+
+    int total = 0, read;
+
+    while (total < len) {
+
+        signal(SIGALRM, alarm_handler);
+        alarm(5);
+
+        read = tcp_read_fd(fd, &buf[total], len - total);
+        if (read <= 0) {
+            return total;
+        }
+        total += read;
+
+        alarm(0);
+    }
+    return total;
+}
+
+
+static void drain(int fd, char *buf) {
+
+    signal(SIGALRM, alarm_handler);
+    alarm(5);
+
+    while (tcp_read_fd(fd, buf, 4) > 0) {}
+
+    alarm(0);
+}
+
+
+int main(void) {
+
+    char server_buf[BUF_SIZE], client_buf[BUF_SIZE], answers[CONNECTIONS];
+    char *eth, *ip1, *ip2;
+
+    int pid, status, listener, conns[CONNECTIONS], i, j, k;
+
+    ipaddr_t saddr;
+
+    eth = getenv("ETH");
+    if (!eth) {
+        fprintf(stderr, "The ETH environment variable must be set!\n");
+        return 1;
+    }
+
+    ip1 = getenv("IP1");
+    ip2 = getenv("IP2");
+    if ((!ip1)||(!ip2)) {
+        fprintf(stderr, "The IP1 and IP2 environment variables must be set!\n");
+        return 1;
+    }
+
+    pid = fork();
+
+    if (pid == -1) {
+        fprintf(stderr, "Unable to fork client process\n");
+        return 1;
+    }
+
+    if (pid == 0) {
+
+        /* Client process running in $IP1 */
+
+        eth[0] = '1';
+
+        for (i = 0; i < CONNECTIONS; i++) {
+            conns[i] = tcp_open();
+            if (conns[i] == -1) {
+                fprintf(stderr, "Client: Opening connection %d failed\n", i);
+                return 1;
+            }
+            if (tcp_connect_fd(conns[i], inet_aton(ip2), 80) != 0) {
+                fprintf(stderr, "Client: Connecting %d failed\n", i);
+                return 1;
+            }
+        }
+
+        for (i = 0; i < CONNECTIONS; i++) {
+            /* which one it is, the server may accept them in any order */
+            client_buf[0] = 'a' + i;
+            for (j = 1; j < BUF_SIZE; j++) {
+                client_buf[j] = (j % (i + 5)) + 48;
+            }
+            if (tcp_write_fd(conns[i], client_buf, BUF_SIZE) != BUF_SIZE) {
+                fprintf(stderr, "Client: Writing request %d failed\n", i);
+                return 1;
+            }
+        }
+
+        for (i = 0; i < CONNECTIONS; i++) {
+            if (read_all(conns[i], client_buf, 2) != 2 ||
+                client_buf[0] != 'a' + i) {
+                fprintf(stderr, "Client: Reading answer %d failed\n", i);
+                return 1;
+            }
+        }
+
+        for (i = 0; i < CONNECTIONS; i++) {
+            if (tcp_close_fd(conns[i]) != 0) {
+                fprintf(stderr, "Client: Closing %d failed\n", i);
+                return 1;
+            }
+        }
+        for (i = 0; i < CONNECTIONS; i++) {
+            drain(conns[i], client_buf);
+            tcp_release(conns[i]);
+        }
+
+        return 0;
+
+    } else {
+
+        /* Server process running in $IP2 */
+
+        eth[0]='2';
+
+        listener = tcp_open();
+        if (listener == -1 ||
+            tcp_listen_backlog(listener, 80, CONNECTIONS) != 0) {
+            fprintf(stderr, "Server: Listening failed\n");
+            return 1;
+        }
+
+        for (i = 0; i < CONNECTIONS; i++) {
+
+            signal(SIGALRM, alarm_handler);
+            alarm(5);
+
+            conns[i] = tcp_accept(listener, &saddr);
+            if (conns[i] == -1) {
+                fprintf(stderr, "Server: Accepting %d failed\n", i);
+                return 1;
+            }
+
+            alarm(0);
+        }
+
+        for (i = CONNECTIONS - 1; i >= 0; i--) {
+            if (read_all(conns[i], server_buf, BUF_SIZE) != BUF_SIZE) {
+                fprintf(stderr, "Server: Reading request %d failed\n", i);
+                return 1;
+            }
+            k = server_buf[0] - 'a';
+            if (k < 0 || k >= CONNECTIONS) {
+                fprintf(stderr, "Server: Request %d is from no one\n", i);
+                return 1;
+            }
+            for (j = 1; j < BUF_SIZE; j++) {
+                if (server_buf[j] != (j % (k + 5)) + 48) {
+                    fprintf(stderr, "Server: Wrong byte at %d of %d\n", j, k);
+                    return 1;
+                }
+            }
+            answers[i] = server_buf[0];
+        }
+
+        for (i = 0; i < CONNECTIONS; i++) {
+            server_buf[0] = answers[i];
+            server_buf[1] = 0;
+            if (tcp_write_close_fd(conns[i], server_buf, 2) != 2) {
+                fprintf(stderr, "Server: Answering %d failed\n", i);
+                return 1;
+            }
+        }
+        for (i = 0; i < CONNECTIONS; i++) {
+            drain(conns[i], server_buf);
+            tcp_release(conns[i]);
+        }
+        tcp_release(listener);
+
+        /* Wait for client process to finish */
+        while (wait(&status) != pid);
+
+        return 0;
+
+    }
+
+
+}
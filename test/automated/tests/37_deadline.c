@@ -0,0 +1,139 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "tcp.h"
+
+/*
+  Test deadline.c
+
+  The server listens and reads with a deadline instead of an alarm. A
+  listen whose deadline passed already must fail right away. The
+  client writes one byte and then waits for an answer; the second read
+  of the server must give up at its deadline, with -1, not before and
+  not much later. Then the server answers, and both close.
+*/
+
+
+int main(void) {
+
+    char client_buf[1], server_buf[1];
+    char *eth, *ip1, *ip2;
+
+    int pid, status, fd;
+    long waited;
+
+    tcp_u32t start;
+    ipaddr_t saddr;
+
+    eth = getenv("ETH");
+    if (!eth) {
+        fprintf(stderr, "The ETH environment variable must be set!\n");
+        return 1;
+    }
+
+    ip1 = getenv("IP1");
+    ip2 = getenv("IP2");
+    if ((!ip1)||(!ip2)) {
+        fprintf(stderr, "The IP1 and IP2 environment variables must be set!\n");
+        return 1;
+    }
+
+    pid = fork();
+
+    if (pid == -1) {
+        fprintf(stderr, "Unable to fork client process\n");
+        return 1;
+    }
+
+    if (pid == 0) {
+
+        /* Client process running in $IP1 */
+        eth[0] = '1';
+
+        if (tcp_socket() != 0) {
+            fprintf(stderr, "Client: Opening socket failed\n");
+            return 1;
+        }
+
+        if (tcp_connect(inet_aton(ip2), 80) != 0) {
+            fprintf(stderr, "Client: Connecting to server failed\n");
+            return 1;
+        }
+
+        client_buf[0] = 'q';
+        if (tcp_write_deadline(0, client_buf, 1, tcp_now() + 5000000) != 1) {
+            fprintf(stderr, "Client: Writing question failed\n");
+            return 1;
+        }
+
+        if (tcp_read_deadline(0, client_buf, 1, tcp_now() + 5000000) != 1 ||
+            client_buf[0] != 'a') {
+            fprintf(stderr, "Client: Reading answer failed\n");
+            return 1;
+        }
+
+        if (tcp_close() != 0) {
+            fprintf(stderr, "Client: Closing connection failed\n");
+            return 1;
+        }
+        while (tcp_read_deadline(0, client_buf, 1,
+                                 tcp_now() + 5000000) > 0) {}
+
+        return 0;
+
+    } else {
+
+        /* Server process running in $IP2 */
+        eth[0]='2';
+
+        if (tcp_socket() != 0) {
+            fprintf(stderr, "Server: Opening socket failed\n");
+            return 1;
+        }
+
+        fd = tcp_open();
+        if (fd == -1 || tcp_listen_deadline(fd, 81, &saddr, tcp_now()) != -1) {
+            fprintf(stderr, "Server: Listening past the deadline worked\n");
+            return 1;
+        }
+        tcp_release(fd);
+
+        if (tcp_listen_deadline(0, 80, &saddr, tcp_now() + 5000000) < 0) {
+            fprintf(stderr, "Server: Listening for client failed\n");
+            return 1;
+        }
+
+        if (tcp_read_deadline(0, server_buf, 1, tcp_now() + 5000000) != 1 ||
+            server_buf[0] != 'q') {
+            fprintf(stderr, "Server: Reading question failed\n");
+            return 1;
+        }
+
+        start = tcp_now();
+        if (tcp_read_deadline(0, server_buf, 1, start + 1000000) != -1) {
+            fprintf(stderr, "Server: Read past the deadline didn't fail\n");
+            return 1;
+        }
+        waited = (long) (tcp_now() - start);
+        if (waited < 1000000 || waited > 1500000) {
+            fprintf(stderr, "Server: Read gave up after %ld usec\n", waited);
+            return 1;
+        }
+
+        server_buf[0] = 'a';
+        if (tcp_write_close(server_buf, 1) != 1) {
+            fprintf(stderr, "Server: Writing answer failed\n");
+            return 1;
+        }
+        while (tcp_read_deadline(0, server_buf, 1,
+                                 tcp_now() + 5000000) > 0) {}
+
+        /* Wait for client process to finish */
+        while (wait(&status) != pid);
+        return 0;
+    }
+
+}
@@ -0,0 +1,187 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "tcp.h"
+
+#define BUF_SIZE 20000
+
+/*
+  Test nonblock.c
+
+  The server runs its listener and connection non-blocking, and waits
+  only in tcp_poll(). Before the client connects, tcp_accept() fails
+  with EAGAIN; tcp_poll() reports the connection once it is there.
+  Until the client writes, tcp_read() fails with EAGAIN. The server
+  asks for the request, reads all of it as tcp_poll() reports it, and
+  closes without waiting; tcp_poll() reports the connection closed
+  once the client closed too.
+*/
+
+
+int main(void) {
+
+    char server_buf[BUF_SIZE], client_buf[BUF_SIZE];
+    char *eth, *ip1, *ip2;
+
+    int pid, status, listener, conn, total, read, j;
+
+    tcp_pollfd_t pfd;
+    ipaddr_t saddr;
+
+    eth = getenv("ETH");
+    if (!eth) {
+        fprintf(stderr, "The ETH environment variable must be set!\n");
+        return 1;
+    }
+
+    ip1 = getenv("IP1");
+    ip2 = getenv("IP2");
+    if ((!ip1)||(!ip2)) {
+        fprintf(stderr, "The IP1 and IP2 environment variables must be set!\n");
+        return 1;
+    }
+
+    pid = fork();
+
+    if (pid == -1) {
+        fprintf(stderr, "Unable to fork client process\n");
+        return 1;
+    }
+
+    if (pid == 0) {
+
+        /* Client process running in $IP1 */
+
+        eth[0] = '1';
+
+        if (tcp_socket() != 0) {
+            fprintf(stderr, "Client: Opening socket failed\n");
+            return 1;
+        }
+
+        /* let the server find no connection first */
+        usleep(200000);
+
+        if (tcp_connect(inet_aton(ip2), 80) != 0) {
+            fprintf(stderr, "Client: Connecting to server failed\n");
+            return 1;
+        }
+
+        if (tcp_read_deadline(0, client_buf, 1, tcp_now() + 5000000) != 1) {
+            fprintf(stderr, "Client: Reading the go ahead failed\n");
+            return 1;
+        }
+
+        for (j = 0; j < BUF_SIZE; j++) {
+            client_buf[j] = (j % 9) + 48;
+        }
+        if (tcp_write(client_buf, BUF_SIZE) != BUF_SIZE) {
+            fprintf(stderr, "Client: Writing request failed\n");
+            return 1;
+        }
+
+        if (tcp_close() != 0) {
+            fprintf(stderr, "Client: Closing connection failed\n");
+            return 1;
+        }
+        while (tcp_read_deadline(0, client_buf, BUF_SIZE,
+                                 tcp_now() + 5000000) > 0) {}
+
+        return 0;
+
+    } else {
+
+        /* Server process running in $IP2 */
+
+        eth[0]='2';
+
+        listener = tcp_open();
+        if (listener == -1 || tcp_nonblock_fd(listener, 1) != 0 ||
+            tcp_listen_backlog(listener, 80, 4) != 0) {
+            fprintf(stderr, "Server: Listening failed\n");
+            return 1;
+        }
+
+        if (tcp_accept(listener, &saddr) != -1 || errno != EAGAIN) {
+            fprintf(stderr, "Server: Accept without a client didn't fail\n");
+            return 1;
+        }
+
+        pfd.fd = listener;
+        pfd.events = TCP_POLLACCEPT;
+        if (tcp_poll(&pfd, 1, 5000000) != 1 ||
+            pfd.revents != TCP_POLLACCEPT) {
+            fprintf(stderr, "Server: Polling for the client failed\n");
+            return 1;
+        }
+
+        conn = tcp_accept(listener, &saddr);
+        if (conn == -1 || tcp_nonblock_fd(conn, 1) != 0) {
+            fprintf(stderr, "Server: Accepting the client failed\n");
+            return 1;
+        }
+
+        if (tcp_read_fd(conn, server_buf, BUF_SIZE) != -1 || errno != EAGAIN) {
+            fprintf(stderr, "Server: Read before the request didn't fail\n");
+            return 1;
+        }
+
+        pfd.fd = conn;
+        pfd.events = TCP_POLLOUT;
+        if (tcp_poll(&pfd, 1, 0) != 1 ||
+            tcp_write_fd(conn, "g", 1) != 1) {
+            fprintf(stderr, "Server: Writing the go ahead failed\n");
+            return 1;
+        }
+
+        total = 0;
+        pfd.events = TCP_POLLIN;
+        do {
+            if (tcp_poll(&pfd, 1, 5000000) != 1 ||
+                !(pfd.revents & TCP_POLLIN)) {
+                fprintf(stderr, "Server: Polling for the request failed\n");
+                return 1;
+            }
+            read = tcp_read_fd(conn, &server_buf[total], BUF_SIZE - total);
+            if (read > 0) {
+                total += read;
+            }
+        } while (read != 0 && total < BUF_SIZE);
+
+        if (total != BUF_SIZE) {
+            fprintf(stderr, "Server: Read %d bytes of the request\n", total);
+            return 1;
+        }
+        for (j = 0; j < BUF_SIZE; j++) {
+            if (server_buf[j] != (j % 9) + 48) {
+                fprintf(stderr, "Server: Wrong byte at %d\n", j);
+                return 1;
+            }
+        }
+
+        if (tcp_close_fd(conn) != 0) {
+            fprintf(stderr, "Server: Closing connection failed\n");
+            return 1;
+        }
+
+        pfd.events = 0;
+        if (tcp_poll(&pfd, 1, 5000000) != 1 ||
+            pfd.revents != TCP_POLLCLOSED) {
+            fprintf(stderr, "Server: Polling for the close failed\n");
+            return 1;
+        }
+
+        tcp_release(conn);
+        tcp_release(listener);
+
+        /* Wait for client process to finish */
+        while (wait(&status) != pid);
+
+        return 0;
+    }
+
+}
@@ -0,0 +1,180 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "tcp.h"
+
+#define BUF_SIZE 50000
+
+/*
+  Test fileno.c
+
+  The server runs the stack from its own poll() loop on tcp_fileno(),
+  and only calls tcp_process_events() and non-blocking calls. It
+  accepts the client, reads its request, answers, and closes; the
+  client uses the blocking calls. The descriptor may not wake the
+  server much more often than packets come in.
+*/
+
+
+int main(void) {
+
+    char server_buf[BUF_SIZE], client_buf[BUF_SIZE];
+    char *eth, *ip1, *ip2;
+
+    int pid, status, listener, conn = -1, total = 0, read, j;
+    int wakeups = 0, closed = 0;
+
+    struct pollfd pfd;
+    tcp_pollfd_t tfd;
+    ipaddr_t saddr;
+
+    eth = getenv("ETH");
+    if (!eth) {
+        fprintf(stderr, "The ETH environment variable must be set!\n");
+        return 1;
+    }
+
+    ip1 = getenv("IP1");
+    ip2 = getenv("IP2");
+    if ((!ip1)||(!ip2)) {
+        fprintf(stderr, "The IP1 and IP2 environment variables must be set!\n");
+        return 1;
+    }
+
+    pid = fork();
+
+    if (pid == -1) {
+        fprintf(stderr, "Unable to fork client process\n");
+        return 1;
+    }
+
+    if (pid == 0) {
+
+        /* Client process running in $IP1 */
+
+        eth[0] = '1';
+
+        if (tcp_socket() != 0) {
+            fprintf(stderr, "Client: Opening socket failed\n");
+            return 1;
+        }
+
+        /* the server idles meanwhile */
+        usleep(300000);
+
+        if (tcp_connect(inet_aton(ip2), 80) != 0) {
+            fprintf(stderr, "Client: Connecting to server failed\n");
+            return 1;
+        }
+
+        for (j = 0; j < BUF_SIZE; j++) {
+            client_buf[j] = (j % 11) + 48;
+        }
+        if (tcp_write(client_buf, BUF_SIZE) != BUF_SIZE) {
+            fprintf(stderr, "Client: Writing request failed\n");
+            return 1;
+        }
+
+        if (tcp_read_deadline(0, client_buf, 4, tcp_now() + 5000000) != 4 ||
+            strcmp(client_buf, "ack")) {
+            fprintf(stderr, "Client: Reading answer failed\n");
+            return 1;
+        }
+
+        if (tcp_close() != 0) {
+            fprintf(stderr, "Client: Closing connection failed\n");
+            return 1;
+        }
+        while (tcp_read_deadline(0, client_buf, BUF_SIZE,
+                                 tcp_now() + 5000000) > 0) {}
+
+        return 0;
+
+    } else {
+
+        /* Server process running in $IP2 */
+
+        eth[0]='2';
+
+        pfd.fd = tcp_fileno();
+        pfd.events = POLLIN;
+        if (pfd.fd == -1) {
+            fprintf(stderr, "Server: No descriptor for the stack\n");
+            return 1;
+        }
+
+        listener = tcp_open();
+        if (listener == -1 || tcp_nonblock_fd(listener, 1) != 0 ||
+            tcp_listen_backlog(listener, 80, 4) != 0) {
+            fprintf(stderr, "Server: Listening failed\n");
+            return 1;
+        }
+
+        while (!closed) {
+
+            if (poll(&pfd, 1, 5000) != 1) {
+                fprintf(stderr, "Server: The descriptor didn't wake us\n");
+                return 1;
+            }
+            wakeups++;
+            if (tcp_process_events() < 0) {
+                fprintf(stderr, "Server: Processing events failed\n");
+                return 1;
+            }
+
+            if (conn == -1) {
+                conn = tcp_accept(listener, &saddr);
+                if (conn != -1) {
+                    tcp_nonblock_fd(conn, 1);
+                }
+                continue;
+            }
+
+            while (total < BUF_SIZE &&
+                   (read = tcp_read_fd(conn, &server_buf[total],
+                                       BUF_SIZE - total)) > 0) {
+                total += read;
+                if (total == BUF_SIZE &&
+                    tcp_write_close_fd(conn, "ack", 4) != 4) {
+                    fprintf(stderr, "Server: Writing answer failed\n");
+                    return 1;
+                }
+            }
+
+            tfd.fd = conn;
+            tfd.events = 0;
+            closed = tcp_poll(&tfd, 1, 0) == 1;
+        }
+
+        if (total != BUF_SIZE) {
+            fprintf(stderr, "Server: Read %d bytes of the request\n", total);
+            return 1;
+        }
+        for (j = 0; j < BUF_SIZE; j++) {
+            if (server_buf[j] != (j % 11) + 48) {
+                fprintf(stderr, "Server: Wrong byte at %d\n", j);
+                return 1;
+            }
+        }
+
+        /* about a segment and an ack each way per wake up */
+        if (wakeups > 4 * BUF_SIZE / DEFAULT_MSS) {
+            fprintf(stderr, "Server: Woken %d times\n", wakeups);
+            return 1;
+        }
+
+        tcp_release(conn);
+        tcp_release(listener);
+
+        /* Wait for client process to finish */
+        while (wait(&status) != pid);
+
+        return 0;
+    }
+
+}
@@ -0,0 +1,141 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "tcp.h"
+
+#define BUF_SIZE 120000
+
+/*
+  Test engine.c
+
+  The server starts the engine, takes the client, and then sleeps
+  without calling us. The client writes more than its send buffer
+  holds, which only fits once the server acks: the engine must do so
+  meanwhile, so that the write is done long before the server wakes.
+  Then the server reads the request, answers, and both close.
+*/
+
+
+int main(void) {
+
+    static char server_buf[BUF_SIZE], client_buf[BUF_SIZE];
+    char *eth, *ip1, *ip2;
+
+    int pid, status, total, read, j;
+
+    ipaddr_t saddr;
+
+    eth = getenv("ETH");
+    if (!eth) {
+        fprintf(stderr, "The ETH environment variable must be set!\n");
+        return 1;
+    }
+
+    ip1 = getenv("IP1");
+    ip2 = getenv("IP2");
+    if ((!ip1)||(!ip2)) {
+        fprintf(stderr, "The IP1 and IP2 environment variables must be set!\n");
+        return 1;
+    }
+
+    pid = fork();
+
+    if (pid == -1) {
+        fprintf(stderr, "Unable to fork client process\n");
+        return 1;
+    }
+
+    if (pid == 0) {
+
+        /* Client process running in $IP1 */
+
+        eth[0] = '1';
+
+        if (tcp_socket() != 0) {
+            fprintf(stderr, "Client: Opening socket failed\n");
+            return 1;
+        }
+
+        if (tcp_connect(inet_aton(ip2), 80) != 0) {
+            fprintf(stderr, "Client: Connecting to server failed\n");
+            return 1;
+        }
+
+        for (j = 0; j < BUF_SIZE; j++) {
+            client_buf[j] = (j % 13) + 48;
+        }
+        /* the server sleeps for 3 seconds */
+        if (tcp_write_deadline(0, client_buf, BUF_SIZE,
+                               tcp_now() + 2000000) != BUF_SIZE) {
+            fprintf(stderr, "Client: Writing request failed\n");
+            return 1;
+        }
+
+        if (tcp_read_deadline(0, client_buf, 4, tcp_now() + 5000000) != 4 ||
+            strcmp(client_buf, "ack")) {
+            fprintf(stderr, "Client: Reading answer failed\n");
+            return 1;
+        }
+
+        if (tcp_close() != 0) {
+            fprintf(stderr, "Client: Closing connection failed\n");
+            return 1;
+        }
+        while (tcp_read_deadline(0, client_buf, BUF_SIZE,
+                                 tcp_now() + 5000000) > 0) {}
+
+        return 0;
+
+    } else {
+
+        /* Server process running in $IP2 */
+
+        eth[0]='2';
+
+        if (tcp_socket() != 0 || tcp_engine_start() != 0) {
+            fprintf(stderr, "Server: Starting the engine failed\n");
+            return 1;
+        }
+
+        if (tcp_listen_deadline(0, 80, &saddr, tcp_now() + 5000000) < 0) {
+            fprintf(stderr, "Server: Listening for client failed\n");
+            return 1;
+        }
+
+        sleep(3);
+
+        total = 0;
+        while (total < BUF_SIZE &&
+               (read = tcp_read_deadline(0, &server_buf[total],
+                                         BUF_SIZE - total,
+                                         tcp_now() + 5000000)) > 0) {
+            total += read;
+        }
+        if (total != BUF_SIZE) {
+            fprintf(stderr, "Server: Read %d bytes of the request\n", total);
+            return 1;
+        }
+        for (j = 0; j < BUF_SIZE; j++) {
+            if (server_buf[j] != (j % 13) + 48) {
+                fprintf(stderr, "Server: Wrong byte at %d\n", j);
+                return 1;
+            }
+        }
+
+        if (tcp_write_close("ack", 4) != 4) {
+            fprintf(stderr, "Server: Writing answer failed\n");
+            return 1;
+        }
+        while (tcp_read_deadline(0, server_buf, BUF_SIZE,
+                                 tcp_now() + 5000000) > 0) {}
+
+        /* Wait for client process to finish */
+        while (wait(&status) != pid);
+
+        return 0;
+    }
+
+}